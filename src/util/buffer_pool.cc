@@ -0,0 +1,113 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace util {
+namespace {
+
+constexpr auto relaxed = std::memory_order_relaxed;
+
+// Returns the index of the smallest class which can hold the given number of
+// bytes, or num_classes if there is no such class.
+std::size_t class_index(std::size_t size) noexcept {
+  const auto& sizes = buffer_pool::class_sizes;
+  return std::lower_bound(sizes.begin(), sizes.end(), size) - sizes.begin();
+}
+
+template <typename T>
+void increment(std::atomic<T>& value, T amount = 1) noexcept {
+  value.store(value.load(relaxed) + amount, relaxed);
+}
+
+template <typename T>
+void decrement(std::atomic<T>& value, T amount = 1) noexcept {
+  value.store(value.load(relaxed) - amount, relaxed);
+}
+
+}  // namespace
+
+void buffer_pool::buffer::reset() noexcept {
+  if (!data_) return;
+  pool_->release(std::exchange(data_, nullptr), std::exchange(size_, 0));
+  pool_ = nullptr;
+}
+
+buffer_pool::buffer_pool(std::size_t max_free_bytes) noexcept
+    : max_free_bytes_(max_free_bytes) {}
+
+buffer_pool::~buffer_pool() noexcept {
+  for (size_class& c : classes_) {
+    assert(c.in_use.load(relaxed) == 0);
+    while (c.free_list) {
+      free_buffer* next = c.free_list->next;
+      delete[] reinterpret_cast<char*>(c.free_list);
+      c.free_list = next;
+    }
+  }
+  assert(oversized_in_use_.load(relaxed) == 0);
+}
+
+buffer_pool::buffer buffer_pool::acquire(std::size_t size) noexcept {
+  const std::size_t index = class_index(size);
+  if (index == num_classes) {
+    increment(oversized_in_use_);
+    increment(oversized_bytes_, size);
+    return buffer(*this, new char[size], size);
+  }
+  size_class& c = classes_[index];
+  const std::size_t class_size = class_sizes[index];
+  increment(c.acquired);
+  increment(c.in_use);
+  if (free_buffer* head = c.free_list) {
+    c.free_list = head->next;
+    decrement(c.free);
+    free_bytes_ -= class_size;
+    return buffer(*this, reinterpret_cast<char*>(head), class_size);
+  }
+  increment(c.allocated);
+  return buffer(*this, new char[class_size], class_size);
+}
+
+void buffer_pool::release(char* data, std::size_t size) noexcept {
+  const std::size_t index = class_index(size);
+  if (index == num_classes) {
+    decrement(oversized_in_use_);
+    decrement(oversized_bytes_, size);
+    delete[] data;
+    return;
+  }
+  size_class& c = classes_[index];
+  assert(class_sizes[index] == size);
+  decrement(c.in_use);
+  if (free_bytes_ + size > max_free_bytes_) {
+    // The pool is holding on to enough memory already.
+    delete[] data;
+    return;
+  }
+  auto* node = reinterpret_cast<free_buffer*>(data);
+  node->next = c.free_list;
+  c.free_list = node;
+  increment(c.free);
+  free_bytes_ += size;
+}
+
+buffer_pool::stats buffer_pool::get_stats() const noexcept {
+  stats result = {};
+  for (std::size_t i = 0; i < num_classes; i++) {
+    const size_class& c = classes_[i];
+    class_stats& out = result.classes[i];
+    out.size = class_sizes[i];
+    out.in_use = c.in_use.load(relaxed);
+    out.free = c.free.load(relaxed);
+    out.acquired = c.acquired.load(relaxed);
+    out.allocated = c.allocated.load(relaxed);
+    result.bytes_in_use += out.in_use * out.size;
+    result.bytes_free += out.free * out.size;
+  }
+  result.oversized_in_use = oversized_in_use_.load(relaxed);
+  result.bytes_in_use += oversized_bytes_.load(relaxed);
+  return result;
+}
+
+}  // namespace util
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "span.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace util {
+
+// A pool of reusable memory buffers, grouped into size classes. Released
+// buffers are kept on a free list for their class so that they can be handed
+// out again without touching the allocator, up to a limit on the total number
+// of free bytes.
+//
+// A pool is not thread-safe: typically each io_context has its own pool, and
+// it is only used from the thread running that context. The statistics are
+// the exception, and may be read from any thread.
+class buffer_pool {
+ public:
+  // The size classes, from smallest to largest. Requests which are larger
+  // than the largest class are allocated individually and never cached.
+  static constexpr std::array<std::size_t, 5> class_sizes = {
+      1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 18};
+  static constexpr std::size_t num_classes = class_sizes.size();
+
+  // A buffer from the pool, which is returned to the pool when destroyed.
+  class buffer {
+   public:
+    // Construct an empty buffer.
+    constexpr buffer() noexcept = default;
+    ~buffer() noexcept { reset(); }
+
+    // Not copyable.
+    buffer(const buffer&) = delete;
+    buffer& operator=(const buffer&) = delete;
+
+    // Movable.
+    buffer(buffer&& other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr)),
+          data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)) {}
+    buffer& operator=(buffer&& other) noexcept {
+      if (this == &other) return *this;
+      reset();
+      pool_ = std::exchange(other.pool_, nullptr);
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+      return *this;
+    }
+
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+    char* data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    operator span<char>() const noexcept { return span<char>(data_, size_); }
+
+    // Return the buffer to the pool, leaving this buffer empty.
+    void reset() noexcept;
+
+   private:
+    friend class buffer_pool;
+    buffer(buffer_pool& pool, char* data, std::size_t size) noexcept
+        : pool_(&pool), data_(data), size_(size) {}
+
+    buffer_pool* pool_ = nullptr;
+    char* data_ = nullptr;
+    std::size_t size_ = 0;
+  };
+
+  struct class_stats {
+    std::size_t size;
+    // The number of buffers currently handed out.
+    std::size_t in_use;
+    // The number of buffers on the free list.
+    std::size_t free;
+    // The total number of buffers which have been requested, and the number
+    // of those requests which needed a new allocation.
+    std::uint64_t acquired;
+    std::uint64_t allocated;
+  };
+
+  struct stats {
+    std::array<class_stats, num_classes> classes;
+    // Buffers larger than the largest size class.
+    std::size_t oversized_in_use;
+    // The total number of bytes in buffers which are in use or free.
+    std::size_t bytes_in_use;
+    std::size_t bytes_free;
+  };
+
+  // Construct a pool which keeps at most max_free_bytes of released buffers.
+  explicit buffer_pool(std::size_t max_free_bytes = 16 << 20) noexcept;
+  // Every buffer must have been returned before the pool is destroyed.
+  ~buffer_pool() noexcept;
+
+  // Not copyable or movable: buffers hold a pointer to their pool.
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  // Get a buffer of at least the given size. The buffer may be larger than
+  // requested, and its contents are unspecified.
+  buffer acquire(std::size_t size) noexcept;
+
+  // Returns a snapshot of the occupancy of the pool.
+  stats get_stats() const noexcept;
+
+ private:
+  // Free buffers are kept in an intrusive list, with the link stored in the
+  // memory of the buffer itself.
+  struct free_buffer {
+    free_buffer* next;
+  };
+
+  struct size_class {
+    free_buffer* free_list = nullptr;
+    std::atomic<std::size_t> in_use = 0;
+    std::atomic<std::size_t> free = 0;
+    std::atomic<std::uint64_t> acquired = 0;
+    std::atomic<std::uint64_t> allocated = 0;
+  };
+
+  void release(char* data, std::size_t size) noexcept;
+
+  std::size_t max_free_bytes_;
+  std::size_t free_bytes_ = 0;
+  std::array<size_class, num_classes> classes_;
+  std::atomic<std::size_t> oversized_in_use_ = 0;
+  std::atomic<std::size_t> oversized_bytes_ = 0;
+};
+
+}  // namespace util
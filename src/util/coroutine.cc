@@ -0,0 +1,69 @@
+#include "coroutine.h"
+
+#include <cassert>
+#include <new>
+
+namespace util {
+namespace {
+
+// Each frame is preceded by a header recording the pool that it came from,
+// padded so that the frame itself keeps the default alignment.
+struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) frame_header {
+  frame_pool* pool;
+};
+
+frame_header* header_of(void* frame) noexcept {
+  return static_cast<frame_header*>(frame) - 1;
+}
+
+}  // namespace
+
+frame_pool::~frame_pool() noexcept {
+  assert(in_use_ == 0);
+  for (free_frame* head : free_lists_) {
+    while (head) {
+      free_frame* next = head->next;
+      ::operator delete(head);
+      head = next;
+    }
+  }
+}
+
+void* frame_pool::allocate(frame_pool* pool, std::size_t size) {
+  const std::size_t total = sizeof(frame_header) + size;
+  const std::size_t index = (total - 1) / class_step;
+  void* block;
+  if (!pool || index >= num_classes) {
+    pool = nullptr;
+    block = ::operator new(total);
+  } else if (free_frame* head = pool->free_lists_[index]) {
+    pool->free_lists_[index] = head->next;
+    block = head;
+  } else {
+    block = ::operator new((index + 1) * class_step);
+  }
+  if (pool) pool->in_use_++;
+  auto* header = new (block) frame_header{pool};
+  return header + 1;
+}
+
+void frame_pool::deallocate(void* frame, std::size_t size) noexcept {
+  frame_header* header = header_of(frame);
+  frame_pool* pool = header->pool;
+  if (!pool) {
+    ::operator delete(header);
+    return;
+  }
+  const std::size_t index = (sizeof(frame_header) + size - 1) / class_step;
+  auto* node = new (header) free_frame{pool->free_lists_[index]};
+  pool->free_lists_[index] = node;
+  pool->in_use_--;
+}
+
+void spawn(task<void> t) noexcept {
+  task<void>::handle coroutine = t.release();
+  coroutine.promise().detached = true;
+  coroutine.resume();
+}
+
+}  // namespace util
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace util {
+
+// Recycles the memory of coroutine frames. A coroutine returning a task<T>
+// allocates its frame from a pool if one of its parameters is a frame_pool&
+// (which is otherwise unused), and from the heap if not. Frames are kept on a
+// free list for their size class when they are released, so a coroutine which
+// is called once per request only allocates the first time.
+//
+// A pool is not thread-safe, and every frame allocated from it must have been
+// released before it is destroyed. Typically a pool belongs to a single
+// connection, which passes it to each coroutine that it calls.
+class frame_pool {
+ public:
+  frame_pool() noexcept = default;
+  ~frame_pool() noexcept;
+
+  // Not copyable or movable: frames hold a pointer to their pool.
+  frame_pool(const frame_pool&) = delete;
+  frame_pool& operator=(const frame_pool&) = delete;
+
+  // Allocate a frame of the given size, from the pool if it is not null and
+  // from the heap otherwise. Either way, the frame must be released with
+  // deallocate().
+  static void* allocate(frame_pool* pool, std::size_t size);
+  static void deallocate(void* frame, std::size_t size) noexcept;
+
+ private:
+  // Frames are grouped into classes by size, in steps of this many bytes.
+  // Larger frames are always allocated from the heap.
+  static constexpr std::size_t class_step = 64;
+  static constexpr std::size_t num_classes = 16;
+
+  struct free_frame {
+    free_frame* next;
+  };
+
+  std::array<free_frame*, num_classes> free_lists_ = {};
+  std::size_t in_use_ = 0;
+};
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+template <typename Arg>
+frame_pool* as_frame_pool(Arg& arg) noexcept {
+  if constexpr (std::is_same_v<Arg, frame_pool>) {
+    return &arg;
+  } else {
+    return nullptr;
+  }
+}
+
+// State which is common to the promise of every task.
+class task_promise_base {
+ public:
+  // GCC reports a variadic operator new as mismatched with the sized operator
+  // delete wherever the call is not inlined (which, without optimisation, is
+  // everywhere), so it is always inlined.
+  template <typename... Args>
+  [[gnu::always_inline]] static void* operator new(std::size_t size,
+                                                   Args&... args) {
+    frame_pool* pool = nullptr;
+    ((pool = pool ? pool : as_frame_pool(args)), ...);
+    return frame_pool::allocate(pool, size);
+  }
+  static void operator delete(void* frame, std::size_t size) noexcept {
+    frame_pool::deallocate(frame, size);
+  }
+
+  // Tasks are lazy: they start running when they are first awaited.
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // When a task finishes, it resumes whichever coroutine awaited it. A task
+  // which finishes without ever suspending returns to the awaiting coroutine
+  // instead, which carries on without suspending at all. A task which was
+  // spawned has no such coroutine, so it destroys itself.
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> self) noexcept {
+      task_promise_base& promise = self.promise();
+      if (promise.state == run_state::inline_start) {
+        promise.state = run_state::finished;
+        return std::noop_coroutine();
+      }
+      if (promise.continuation) return promise.continuation;
+      if (promise.detached) self.destroy();
+      return std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  // Like the rest of this library, tasks do not use exceptions.
+  void unhandled_exception() noexcept { std::terminate(); }
+
+  // Whether the task is running inside the call which started it. Without
+  // this, each task which finished without suspending would resume the
+  // awaiting coroutine from inside its own frame, so a loop which awaits such
+  // tasks would use more stack on every iteration unless the compiler turns
+  // the transfer of control into a tail call (which GCC only does when
+  // optimizing).
+  enum class run_state { not_started, inline_start, suspended, finished };
+
+  std::coroutine_handle<> continuation;
+  run_state state = run_state::not_started;
+  bool detached = false;
+};
+
+template <typename T>
+class task_promise : public task_promise_base {
+ public:
+  task<T> get_return_object() noexcept;
+  template <typename U>
+  void return_value(U&& value) noexcept {
+    value_.emplace(std::forward<U>(value));
+  }
+  T take() noexcept { return std::move(*value_); }
+
+ private:
+  std::optional<T> value_;
+};
+
+template <>
+class task_promise<void> : public task_promise_base {
+ public:
+  task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+  void take() noexcept {}
+};
+
+}  // namespace detail
+
+// A coroutine which produces a value of type T. A task does not start running
+// until it is awaited, at which point the awaiting coroutine is suspended
+// until the task finishes, and then resumes with its value. Control passes
+// between the two directly, without going through the executor, and a task
+// which finishes without suspending does not suspend the awaiting coroutine
+// at all.
+template <typename T>
+class [[nodiscard]] task {
+ public:
+  using promise_type = detail::task_promise<T>;
+  using handle = std::coroutine_handle<promise_type>;
+
+  constexpr task() noexcept = default;
+  explicit task(handle h) noexcept : handle_(h) {}
+  ~task() noexcept {
+    if (handle_) handle_.destroy();
+  }
+
+  // Not copyable.
+  task(const task&) = delete;
+  task& operator=(const task&) = delete;
+
+  // Movable.
+  task(task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  task& operator=(task&& other) noexcept {
+    if (this == &other) return *this;
+    if (handle_) handle_.destroy();
+    handle_ = std::exchange(other.handle_, {});
+    return *this;
+  }
+
+  // Give up ownership of the coroutine.
+  handle release() noexcept { return std::exchange(handle_, {}); }
+
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      handle coroutine;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> caller) noexcept {
+        using run_state = detail::task_promise_base::run_state;
+        promise_type& promise = coroutine.promise();
+        promise.continuation = caller;
+        promise.state = run_state::inline_start;
+        coroutine.resume();
+        if (promise.state == run_state::finished) return false;
+        promise.state = run_state::suspended;
+        return true;
+      }
+      T await_resume() noexcept { return coroutine.promise().take(); }
+    };
+    return awaiter{handle_};
+  }
+
+ private:
+  handle handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() noexcept {
+  return task<T>(task<T>::handle::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+  return task<void>(task<void>::handle::from_promise(*this));
+}
+
+}  // namespace detail
+
+// Start running a task without waiting for it. The task destroys itself when
+// it finishes.
+void spawn(task<void>) noexcept;
+
+// Adapts an operation which reports its result to a continuation, as most
+// operations in this library do, so that a coroutine can await it. The start
+// function is called with the continuation when the coroutine suspends, and
+// the coroutine resumes with the value passed to the continuation, which must
+// be invoked exactly once. A continuation which is invoked before the start
+// function returns (such as by an operation which completed inline) does not
+// suspend the coroutine at all.
+template <typename T, typename Start>
+class callback_awaitable {
+ public:
+  explicit callback_awaitable(Start start) noexcept
+      : start_(std::move(start)) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> caller) noexcept {
+    caller_ = caller;
+    if constexpr (std::is_void_v<T>) {
+      start_([this] { complete(); });
+    } else {
+      start_([this](T value) {
+        value_.emplace(std::move(value));
+        complete();
+      });
+    }
+    if (done_) return false;
+    suspended_ = true;
+    return true;
+  }
+
+  T await_resume() noexcept {
+    if constexpr (!std::is_void_v<T>) return std::move(*value_);
+  }
+
+ private:
+  void complete() noexcept {
+    done_ = true;
+    if (suspended_) caller_.resume();
+  }
+
+  struct empty {};
+  using storage =
+      std::conditional_t<std::is_void_v<T>, empty, std::optional<T>>;
+
+  Start start_;
+  std::coroutine_handle<> caller_;
+  bool done_ = false;
+  bool suspended_ = false;
+  [[no_unique_address]] storage value_;
+};
+
+template <typename T, typename Start>
+callback_awaitable<T, Start> await_callback(Start start) noexcept {
+  return callback_awaitable<T, Start>(std::move(start));
+}
+
+}  // namespace util
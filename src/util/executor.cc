@@ -1,37 +1,196 @@
 #include "executor.h"
 
+#include <algorithm>
+#include <deque>
 #include <thread>
+#include <utility>
 
 namespace util {
 
-// Order time points in *descending* order so that they are put in *ascending*
-// order in a heap.
-static constexpr auto by_time = [](auto& l, auto& r) {
-  return l.time > r.time;
-};
+// The pool and worker index of the calling thread, if it is a pool worker.
+static thread_local const thread_pool_executor* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+bool executor::timer::cancel() noexcept {
+  return owner_ && std::exchange(owner_, nullptr)->cancel(id_);
+}
+
+executor::timer executor::schedule(task f) noexcept {
+  return schedule_at(clock::now(), std::move(f));
+}
 
-void executor::schedule(std::function<void()> f) noexcept {
-  schedule_at(clock::now(), std::move(f));
+executor::timer executor::schedule_in(duration d, task f) noexcept {
+  return schedule_at(clock::now() + d, std::move(f));
 }
 
-void executor::schedule_in(duration d, std::function<void()> f) noexcept {
-  schedule_at(clock::now() + d, std::move(f));
+executor::timer serial_executor::schedule_at(time_point t, task f) noexcept {
+  return make_timer(work_.add(t, std::move(f)));
 }
 
-void serial_executor::schedule_at(time_point t,
-                                  std::function<void()> f) noexcept {
-  work_.push_back({t, std::move(f)});
-  std::push_heap(work_.begin(), work_.end(), by_time);
+executor::timer serial_executor::schedule(task f) noexcept {
+  return make_timer(work_.push(std::move(f)));
 }
 
 void serial_executor::run() {
   while (!work_.empty()) {
-    std::pop_heap(work_.begin(), work_.end(), by_time);
-    work_item work = std::move(work_.back());
-    work_.pop_back();
-    std::this_thread::sleep_until(work.time);
-    work.resume();
+    if (work_.num_expired() == 0) {
+      std::this_thread::sleep_until(*work_.next_expiry());
+      work_.advance(clock::now());
+      continue;
+    }
+    work_.pop()();
+  }
+}
+
+bool serial_executor::cancel(timer_id id) noexcept { return work_.cancel(id); }
+
+struct thread_pool_executor::worker {
+  std::mutex mutex;
+  std::deque<task> tasks;
+  std::thread thread;
+};
+
+thread_pool_executor::thread_pool_executor(int size) {
+  if (size <= 0) size = std::max(1u, std::thread::hardware_concurrency());
+  workers_.reserve(size);
+  for (int i = 0; i < size; i++) workers_.push_back(std::make_unique<worker>());
+  // Workers are only started once all of the queues exist, since any worker may
+  // try to steal from any other.
+  for (int i = 0; i < size; i++) {
+    workers_[i]->thread = std::thread([this, i] { run(i); });
+  }
+}
+
+thread_pool_executor::~thread_pool_executor() noexcept {
+  wait();
+  {
+    std::unique_lock lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) worker->thread.join();
+}
+
+executor::timer thread_pool_executor::schedule_at(time_point t,
+                                                  task f) noexcept {
+  pending_++;
+  if (t <= clock::now()) {
+    push(std::move(f));
+    return timer();
+  }
+  std::unique_lock lock(mutex_);
+  const std::optional<time_point> next = timers_.next_expiry();
+  const timer_id id = timers_.add(t, std::move(f));
+  // If this is now the earliest timer, any sleeping worker needs to recompute
+  // how long it should sleep for.
+  if (!next || t < *next) wake_.notify_one();
+  return make_timer(id);
+}
+
+void thread_pool_executor::wait() noexcept {
+  std::unique_lock lock(mutex_);
+  idle_.wait(lock, [&] { return pending_ == 0; });
+}
+
+bool thread_pool_executor::cancel(timer_id id) noexcept {
+  {
+    std::unique_lock lock(mutex_);
+    if (!timers_.cancel(id)) return false;
+  }
+  finish();
+  return true;
+}
+
+void thread_pool_executor::finish() noexcept {
+  if (--pending_ == 0) {
+    std::unique_lock lock(mutex_);
+    idle_.notify_all();
+  }
+}
+
+void thread_pool_executor::run(int index) noexcept {
+  current_pool = this;
+  current_worker = index;
+  task f;
+  while (true) {
+    if (pop(index, f) || steal(index, f)) {
+      f();
+      f = nullptr;
+      finish();
+      continue;
+    }
+    // There is no ready work anywhere. Check for any timers that are due, and
+    // otherwise sleep until either the next timer is due or more work arrives.
+    std::unique_lock lock(mutex_);
+    if (stopping_) return;
+    timers_.advance(clock::now());
+    const std::size_t num_due = timers_.num_expired();
+    for (std::size_t i = 0; i < num_due; i++) enqueue(index, timers_.pop());
+    if (num_due > 0) {
+      // Other sleeping workers can steal from this worker's queue.
+      if (num_due > 1 && sleeping_ > 0) wake_.notify_all();
+      continue;
+    }
+    sleeping_++;
+    // Work may have been pushed after pop() and steal() failed but before
+    // sleeping_ was incremented, in which case the producer will not have
+    // notified anyone. Check again now that sleeping_ has been updated.
+    if (queued_ == 0) {
+      if (const std::optional<time_point> next = timers_.next_expiry()) {
+        wake_.wait_until(lock, *next);
+      } else {
+        wake_.wait(lock);
+      }
+    }
+    sleeping_--;
+  }
+}
+
+void thread_pool_executor::push(task f) noexcept {
+  const std::size_t index =
+      current_pool == this
+          ? current_worker
+          : next_worker_.fetch_add(1, std::memory_order_relaxed) %
+                workers_.size();
+  enqueue(index, std::move(f));
+  if (sleeping_ > 0) {
+    std::unique_lock lock(mutex_);
+    wake_.notify_one();
+  }
+}
+
+void thread_pool_executor::enqueue(int index, task f) noexcept {
+  worker& w = *workers_[index];
+  std::unique_lock lock(w.mutex);
+  w.tasks.push_back(std::move(f));
+  queued_++;
+}
+
+bool thread_pool_executor::pop(int index, task& f) noexcept {
+  worker& w = *workers_[index];
+  std::unique_lock lock(w.mutex);
+  if (w.tasks.empty()) return false;
+  // Workers take their own work from the back of the queue, since it is most
+  // likely to still be in cache.
+  f = std::move(w.tasks.back());
+  w.tasks.pop_back();
+  queued_--;
+  return true;
+}
+
+bool thread_pool_executor::steal(int index, task& f) noexcept {
+  const int size = workers_.size();
+  for (int i = 1; i < size; i++) {
+    worker& victim = *workers_[(index + i) % size];
+    std::unique_lock lock(victim.mutex);
+    if (victim.tasks.empty()) continue;
+    // Thieves take the oldest work from the front of the queue.
+    f = std::move(victim.tasks.front());
+    victim.tasks.pop_front();
+    queued_--;
+    return true;
   }
+  return false;
 }
 
 }  // namespace util
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "coroutine.h"
+#include "function.h"
+#include "timer_wheel.h"
 
 namespace util {
 
@@ -10,35 +18,127 @@ class executor {
   using clock = std::chrono::steady_clock;
   using time_point = clock::time_point;
   using duration = clock::duration;
-  using task = std::function<void()>;
+  // Tasks have enough inline storage for a pending IO operation (a handle, a
+  // buffer and a continuation) so that scheduling one does not allocate.
+  using task = unique_function<void(), 2 * default_function_storage>;
+
+  // A handle to a scheduled task, which can be used to cancel it. A timer does
+  // not own the task: destroying the handle leaves the task scheduled.
+  class timer {
+   public:
+    // Construct an empty timer, which does not refer to any task.
+    constexpr timer() noexcept = default;
+
+    // Cancel the task if it has not started running yet. Returns true if the
+    // task was cancelled, or false if it already ran, was already cancelled,
+    // or cannot be cancelled.
+    bool cancel() noexcept;
+
+   private:
+    friend class executor;
+    constexpr timer(executor& owner, timer_id id) noexcept
+        : owner_(&owner), id_(id) {}
+
+    executor* owner_ = nullptr;
+    timer_id id_ = {};
+  };
 
   constexpr executor() noexcept = default;
   virtual ~executor() noexcept = default;
 
   // Schedule a task to run at a certain point in time.
-  virtual void schedule_at(time_point time, task) noexcept = 0;
+  virtual timer schedule_at(time_point time, task) noexcept = 0;
 
   // Schedule a task to run now.
-  void schedule(task f) noexcept;
+  virtual timer schedule(task f) noexcept;
 
   // Schedule a task to run a certain amount of time from now.
-  void schedule_in(duration, task) noexcept;
+  timer schedule_in(duration, task) noexcept;
+  // Suspend the calling coroutine for a certain amount of time, after which it
+  // resumes on this executor.
+  auto schedule_in(duration d) noexcept {
+    return await_callback<void>(
+        [this, d](auto resume) { schedule_in(d, std::move(resume)); });
+  }
+
+ protected:
+  // Build a handle for a task with the given id. When it is cancelled, the
+  // handle will call cancel() with the same id.
+  timer make_timer(timer_id id) noexcept { return timer(*this, id); }
+
+  // Cancel the task with the given id. Returns true if the task was cancelled.
+  virtual bool cancel(timer_id) noexcept = 0;
 };
 
 // An executor which runs all work in a single thread.
 class serial_executor final : public executor {
  public:
-  void schedule_at(time_point, task) noexcept override;
+  timer schedule_at(time_point, task) noexcept override;
+  timer schedule(task) noexcept override;
 
   // Run work until there is no more work scheduled.
   void run();
 
  private:
-  struct work_item {
-    time_point time;
-    task resume;
-  };
-  std::vector<work_item> work_;
+  bool cancel(timer_id) noexcept override;
+
+  timer_wheel<task> work_;
+};
+
+// An executor which runs work on a fixed set of worker threads. Every worker
+// has its own queue of ready tasks: tasks scheduled from a worker are pushed
+// onto that worker's queue, tasks scheduled from any other thread are
+// distributed round-robin, and workers which run out of work steal from the
+// others. Tasks scheduled for the future are held in a shared timer queue until
+// they are due.
+// Only tasks scheduled for the future can be cancelled: once a task is in a
+// worker queue, its timer is empty.
+class thread_pool_executor final : public executor {
+ public:
+  // Start a pool with the given number of worker threads. If size is not
+  // positive, one worker is started for each available hardware thread.
+  explicit thread_pool_executor(int size = 0);
+
+  // Waits for all scheduled work to finish and then stops the workers.
+  ~thread_pool_executor() noexcept override;
+
+  // Not copyable or movable: workers hold a pointer to the pool.
+  thread_pool_executor(const thread_pool_executor&) = delete;
+  thread_pool_executor& operator=(const thread_pool_executor&) = delete;
+
+  // Schedule a task to run at a certain point in time. This may be called from
+  // any thread.
+  timer schedule_at(time_point, task) noexcept override;
+
+  // Block until there is no more work scheduled or running.
+  void wait() noexcept;
+
+ private:
+  struct worker;
+
+  bool cancel(timer_id) noexcept override;
+  void finish() noexcept;
+  void run(int index) noexcept;
+  void push(task) noexcept;
+  void enqueue(int index, task) noexcept;
+  bool pop(int index, task&) noexcept;
+  bool steal(int index, task&) noexcept;
+
+  std::vector<std::unique_ptr<worker>> workers_;
+  // Number of tasks which have been scheduled but have not finished running.
+  std::atomic<std::size_t> pending_ = 0;
+  // Number of tasks sitting in worker queues.
+  std::atomic<std::size_t> queued_ = 0;
+  // Number of workers waiting on wake_.
+  std::atomic<int> sleeping_ = 0;
+  // Counter used for distributing work which is scheduled by external threads.
+  std::atomic<std::size_t> next_worker_ = 0;
+  // Guards timers_ and stopping_, and is used for sleeping and waiting.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  timer_wheel<task> timers_;
+  bool stopping_ = false;
 };
 
 }  // namespace util
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace util {
+
+// The default amount of inline storage in a unique_function, in bytes.
+inline constexpr std::size_t default_function_storage = 64;
+
+template <typename Signature,
+          std::size_t storage_size = default_function_storage>
+class unique_function;
+
+// A type-erased callable, like std::function, except that it is move-only and
+// so can hold move-only callables. Any callable which fits in storage_size
+// bytes and can be moved without throwing is stored inline, without any heap
+// allocation. Larger callables are stored on the heap.
+template <typename R, typename... Args, std::size_t storage_size>
+class unique_function<R(Args...), storage_size> {
+ public:
+  // Construct an empty function.
+  constexpr unique_function() noexcept = default;
+  constexpr unique_function(std::nullptr_t) noexcept {}
+
+  // Construct a function from any compatible callable.
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, unique_function> &&
+                std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  unique_function(F&& f) noexcept {
+    using T = std::decay_t<F>;
+    if constexpr (stored_inline<T>) {
+      new (storage_) T(std::forward<F>(f));
+    } else {
+      new (storage_) T*(new T(std::forward<F>(f)));
+    }
+    vtable_ = &vtable_for<T>;
+  }
+
+  ~unique_function() noexcept { reset(); }
+
+  // Not copyable.
+  unique_function(const unique_function&) = delete;
+  unique_function& operator=(const unique_function&) = delete;
+
+  // Movable.
+  unique_function(unique_function&& other) noexcept
+      : vtable_(std::exchange(other.vtable_, nullptr)) {
+    if (vtable_) vtable_->relocate(other.storage_, storage_);
+  }
+
+  unique_function& operator=(unique_function&& other) noexcept {
+    if (this == &other) return *this;
+    reset();
+    vtable_ = std::exchange(other.vtable_, nullptr);
+    if (vtable_) vtable_->relocate(other.storage_, storage_);
+    return *this;
+  }
+
+  unique_function& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  explicit operator bool() const noexcept { return vtable_ != nullptr; }
+
+  // Invoke the stored callable. Requires the function to be non-empty.
+  R operator()(Args... args) {
+    assert(vtable_);
+    return vtable_->invoke(storage_, std::forward<Args>(args)...);
+  }
+
+ private:
+  static_assert(storage_size >= sizeof(void*));
+
+  struct vtable {
+    R (*invoke)(void* storage, Args&&... args);
+    // Move the callable from one storage area to another, destroying the
+    // original.
+    void (*relocate)(void* from, void* to) noexcept;
+    void (*destroy)(void* storage) noexcept;
+  };
+
+  template <typename T>
+  static constexpr bool stored_inline =
+      sizeof(T) <= storage_size &&
+      alignof(T) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<T>;
+
+  template <typename T>
+  static T& get(void* storage) noexcept {
+    if constexpr (stored_inline<T>) {
+      return *std::launder(static_cast<T*>(storage));
+    } else {
+      return **static_cast<T**>(storage);
+    }
+  }
+
+  template <typename T>
+  static R invoke(void* storage, Args&&... args) {
+    if constexpr (std::is_void_v<R>) {
+      std::invoke(get<T>(storage), std::forward<Args>(args)...);
+    } else {
+      return std::invoke(get<T>(storage), std::forward<Args>(args)...);
+    }
+  }
+
+  template <typename T>
+  static void relocate(void* from, void* to) noexcept {
+    if constexpr (stored_inline<T>) {
+      T& value = get<T>(from);
+      new (to) T(std::move(value));
+      value.~T();
+    } else {
+      new (to) T*(*static_cast<T**>(from));
+    }
+  }
+
+  template <typename T>
+  static void destroy(void* storage) noexcept {
+    if constexpr (stored_inline<T>) {
+      get<T>(storage).~T();
+    } else {
+      delete &get<T>(storage);
+    }
+  }
+
+  template <typename T>
+  static constexpr vtable vtable_for = {&invoke<T>, &relocate<T>, &destroy<T>};
+
+  void reset() noexcept {
+    if (vtable_) std::exchange(vtable_, nullptr)->destroy(storage_);
+  }
+
+  alignas(std::max_align_t) unsigned char storage_[storage_size];
+  const vtable* vtable_ = nullptr;
+};
+
+}  // namespace util
@@ -0,0 +1,141 @@
+#include "header_scanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTIL_HEADER_SCANNER_X86 1
+#endif
+
+namespace util {
+namespace {
+
+// The scanner processes its input in blocks of this many bytes.
+constexpr std::size_t block_size = 64;
+
+// Returns a mask in which bit i is set if block[i] is a '\n'. The block must
+// contain block_size readable bytes.
+using newline_mask_function = std::uint64_t (*)(const char* block) noexcept;
+
+std::uint64_t newline_mask_scalar(const char* block) noexcept {
+  std::uint64_t mask = 0;
+  for (std::size_t i = 0; i < block_size; i++) {
+    mask |= std::uint64_t{block[i] == '\n'} << i;
+  }
+  return mask;
+}
+
+#ifdef UTIL_HEADER_SCANNER_X86
+__attribute__((target("sse2")))
+std::uint64_t newline_mask_sse2(const char* block) noexcept {
+  const __m128i newline = _mm_set1_epi8('\n');
+  std::uint64_t mask = 0;
+  for (std::size_t i = 0; i < block_size; i += 16) {
+    const __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+    const std::uint32_t bits =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+    mask |= std::uint64_t{bits} << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+std::uint64_t newline_mask_avx2(const char* block) noexcept {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i low =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+  const __m256i high =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+  const std::uint32_t low_bits =
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline));
+  const std::uint32_t high_bits =
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline));
+  return std::uint64_t{high_bits} << 32 | low_bits;
+}
+#endif
+
+// Pick the best implementation which the CPU supports.
+newline_mask_function select_newline_mask() noexcept {
+#ifdef UTIL_HEADER_SCANNER_X86
+  // This runs during static initialization, so the CPU model has to be
+  // initialized explicitly before it is queried.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return newline_mask_avx2;
+  if (__builtin_cpu_supports("sse2")) return newline_mask_sse2;
+#endif
+  return newline_mask_scalar;
+}
+
+const newline_mask_function newline_mask = select_newline_mask();
+
+}  // namespace
+
+header_scanner::scan_result header_scanner::scan(
+    std::string_view input) noexcept {
+  const char* const data = input.data();
+  const std::size_t size = input.size();
+  // Scan whole blocks at a time, visiting each newline in the block.
+  while (position_ + block_size <= size) {
+    std::uint64_t mask = newline_mask(data + position_);
+    while (mask) {
+      const std::size_t end = position_ + __builtin_ctzll(mask);
+      mask &= mask - 1;
+      switch (end_line(input, end)) {
+        case line_kind::line:
+          break;
+        case line_kind::end:
+          position_ = end + 1;
+          return scan_result::complete;
+        case line_kind::overflow:
+          return scan_result::too_many_lines;
+      }
+    }
+    position_ += block_size;
+  }
+  // Scan whatever is left over one byte at a time.
+  for (; position_ < size; position_++) {
+    if (data[position_] != '\n') continue;
+    switch (end_line(input, position_)) {
+      case line_kind::line:
+        break;
+      case line_kind::end:
+        position_++;
+        return scan_result::complete;
+      case line_kind::overflow:
+        return scan_result::too_many_lines;
+    }
+  }
+  return scan_result::incomplete;
+}
+
+void header_scanner::reset() noexcept {
+  position_ = 0;
+  start_ = 0;
+  line_start_ = 0;
+  num_lines_ = 0;
+}
+
+header_scanner::line_kind header_scanner::end_line(std::string_view input,
+                                                   std::size_t end) noexcept {
+  const std::size_t begin = line_start_;
+  line_start_ = end + 1;
+  // A line is empty if it contains nothing other than '\r'. For any other
+  // line, this stops at the first character.
+  bool empty = true;
+  for (std::size_t i = begin; i < end; i++) {
+    if (input[i] != '\r') {
+      empty = false;
+      break;
+    }
+  }
+  if (empty) {
+    if (num_lines_ > 0) return line_kind::end;
+    // Skip empty lines before the start line.
+    start_ = line_start_;
+    return line_kind::line;
+  }
+  if (num_lines_ == max_lines) return line_kind::overflow;
+  line_ends_[num_lines_++] = end;
+  return line_kind::line;
+}
+
+}  // namespace util
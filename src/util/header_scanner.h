@@ -0,0 +1,68 @@
+#pragma once
+
+#include "span.h"
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace util {
+
+// Incrementally finds the end of an HTTP message header, recording the
+// boundaries of every line on the way. The header is fed to the scanner as it
+// arrives, and each call only examines bytes that previous calls have not
+// seen. Newlines are located with SIMD instructions where the CPU supports
+// them.
+//
+// Lines may end with either "\r\n" or a bare "\n". Empty lines before the
+// first line are ignored, and the header ends at the first empty line after
+// it.
+class header_scanner {
+ public:
+  // The maximum number of lines (including the start line) in a header.
+  static constexpr std::size_t max_lines = 128;
+
+  enum class scan_result {
+    // The end of the header has not been seen yet.
+    incomplete,
+    // The end of the header has been found.
+    complete,
+    // The header has more than max_lines lines.
+    too_many_lines,
+  };
+
+  // Scan the input, which is everything received so far. The input must begin
+  // with the same bytes as were passed to previous calls since the last
+  // reset().
+  scan_result scan(std::string_view input) noexcept;
+
+  // Prepare to scan a new header.
+  void reset() noexcept;
+
+  // The number of bytes in the header, including the final empty line. Only
+  // valid once scan() has returned complete.
+  std::size_t size() const noexcept { return position_; }
+
+  // The offset of the first line of the header.
+  std::size_t start() const noexcept { return start_; }
+
+  // The offsets of the '\n' character at the end of each non-empty line of
+  // the header, in order. Each line begins immediately after the end of the
+  // previous one (or at start() for the first line).
+  span<const std::uint32_t> line_ends() const noexcept {
+    return span<const std::uint32_t>(line_ends_.data(), num_lines_);
+  }
+
+ private:
+  enum class line_kind { line, end, overflow };
+  // Record a line ending at the given offset.
+  line_kind end_line(std::string_view input, std::size_t end) noexcept;
+
+  std::size_t position_ = 0;
+  std::size_t start_ = 0;
+  std::size_t line_start_ = 0;
+  std::size_t num_lines_ = 0;
+  std::array<std::uint32_t, max_lines> line_ends_;
+};
+
+}  // namespace util
@@ -1,14 +1,22 @@
 #include "http.h"
 
+#include "coroutine.h"
+#include "header_scanner.h"
 #include "status_managers.h"
 
 #include <charconv>
-#include <regex>
+#include <cstring>
+#include <memory>
+#include <sstream>
 
 namespace util {
 namespace {
 
-using handler_map = std::map<std::string, http_server::handler>;
+using handler_map = std::map<std::string, http_server::handler, std::less<>>;
+using static_response_map =
+    std::map<std::string, http_static_response, std::less<>>;
+using websocket_handler_map =
+    std::map<std::string, http_server::websocket_handler, std::less<>>;
 
 struct http_status_manager_base : status_manager {
   constexpr std::uint64_t domain_id() const noexcept final {
@@ -26,6 +34,10 @@ struct http_status_manager_base : status_manager {
         return "bad_request";
       case http_status::not_found:
         return "not_found";
+      case http_status::request_timeout:
+        return "request_timeout";
+      case http_status::upgrade_required:
+        return "upgrade_required";
       case http_status::payload_too_large:
         return "payload_too_large";
       case http_status::request_header_fields_too_large:
@@ -71,71 +83,112 @@ constexpr char canned_response[] =
     "\r\n"
     "Hello, World!";
 
-struct header_data {
-  span<char> header;
-  span<char> trailing_bytes;
+struct request_line {
+  http_method method;
+  uri_view target;
+  // True if the protocol version keeps connections open by default, which is
+  // the case for HTTP/1.1 but not for HTTP/1.0.
+  bool persistent;
 };
 
-// Asynchronously read a HTTP header. Returns a header_data struct containing
-// two spans: the first span is the header, while the second span is any
-// trailing bytes which were not part of the header. The caller must consider
-// the trailing bytes as a prefix for any subsequent reads.
-void read_request_header(
-    tcp::stream& client, span<char> buffer,
-    std::function<void(result<header_data>)> done) noexcept {
-  struct reader {
-    tcp::stream& client;
-    span<char> buffer;
-    std::function<void(result<header_data>)> done;
-    span<char>::size_type bytes_read = 0;
-    int trailing_newlines = 0;
-    void read() noexcept {
-      auto free_space = buffer.subspan(bytes_read);
-      if (free_space.empty()) {
-        done(error{http_status::request_header_fields_too_large});
-      } else {
-        client.read_some(free_space, *this);
-      }
-    }
-    void operator()(result<span<char>> bytes) noexcept {
-      if (bytes.success()) {
-        // Scan the new input for two consecutive newline characters. '\r' is
-        // ignored, so the code will accept both '\r\n\r\n' and '\n\n'.
-        for (char& c : *bytes) {
-          switch (c) {
-            case '\r':
-              break;
-            case '\n':
-              trailing_newlines++;
-              if (trailing_newlines == 2) {
-                char* begin = buffer.data();
-                char* end = &c + 1;
-                span<char> header(begin, end - begin);
-                span<char> trailing(end, buffer.end() - end);
-                done(header_data{header, trailing});
-                return;
-              }
-              break;
-            default:
-              trailing_newlines = 0;
-              break;
-          }
-        }
-        bytes_read += bytes->size();
-        // The end of the header was not found, so we need to keep reading.
-        read();
-      } else {
-        done(error{std::move(bytes).status()});
-      }
-    }
-  };
-  reader{client, buffer, std::move(done)}.read();
+constexpr bool is_whitespace(char c) noexcept {
+  return c == ' ' || c == '\t' || c == '\r';
 }
 
-struct request_line {
-  http_method method;
-  uri target;
+std::string_view trim(std::string_view value) noexcept {
+  const char* i = value.data();
+  const char* j = i + value.size();
+  while (i != j && is_whitespace(*i)) ++i;
+  while (j != i && is_whitespace(j[-1])) --j;
+  return std::string_view(i, j - i);
+}
+
+// ASCII-only, locale-independent case folding.
+constexpr char to_lower(char c) noexcept {
+  return 'A' <= c && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+constexpr bool equals_ignore_case(std::string_view l,
+                                  std::string_view r) noexcept {
+  if (l.size() != r.size()) return false;
+  for (std::size_t i = 0; i < l.size(); i++) {
+    if (to_lower(l[i]) != to_lower(r[i])) return false;
+  }
+  return true;
+}
+
+// The lowercase names of the well-known headers, indexed by http_header.
+constexpr std::string_view known_header_names[] = {
+    "",
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "authorization",
+    "cache-control",
+    "connection",
+    "content-length",
+    "content-type",
+    "cookie",
+    "expect",
+    "host",
+    "if-modified-since",
+    "if-none-match",
+    "origin",
+    "range",
+    "referer",
+    "sec-websocket-key",
+    "sec-websocket-protocol",
+    "sec-websocket-version",
+    "transfer-encoding",
+    "upgrade",
+    "user-agent",
 };
+constexpr std::size_t num_known_headers = std::size(known_header_names);
+static_assert(num_known_headers - 1 == (std::size_t)http_header::user_agent);
+
+// A perfect hash of the well-known header names, which only looks at the
+// length and three characters of the name. The constants were chosen by
+// search so that no two known names collide, which is checked below.
+constexpr std::size_t header_hash_size = 64;
+constexpr std::size_t header_hash(std::string_view name) noexcept {
+  if (name.empty()) return 0;
+  const std::size_t first = to_lower(name.front());
+  const std::size_t middle = to_lower(name[name.size() / 2]);
+  const std::size_t last = to_lower(name.back());
+  return (name.size() + 7 * first + 7 * middle + last) % header_hash_size;
+}
+
+constexpr std::array<http_header, header_hash_size> make_header_table() {
+  std::array<http_header, header_hash_size> table = {};
+  for (std::size_t i = 1; i < num_known_headers; i++) {
+    table[header_hash(known_header_names[i])] = http_header{(unsigned char)i};
+  }
+  return table;
+}
+constexpr std::array<http_header, header_hash_size> header_table =
+    make_header_table();
+
+constexpr bool header_hash_is_perfect() {
+  for (std::size_t i = 1; i < num_known_headers; i++) {
+    const http_header h = header_table[header_hash(known_header_names[i])];
+    if (h != http_header{(unsigned char)i}) return false;
+  }
+  return true;
+}
+static_assert(header_hash_is_perfect(), "known header names collide");
+
+// Returns true if a comma-separated header value such as `keep-alive, Upgrade`
+// contains the given token, ignoring case.
+bool has_token(std::string_view list, std::string_view token) noexcept {
+  while (!list.empty()) {
+    const std::size_t comma = list.find(',');
+    const std::string_view item = trim(list.substr(0, comma));
+    if (equals_ignore_case(item, token)) return true;
+    if (comma == std::string_view::npos) break;
+    list.remove_prefix(comma + 1);
+  }
+  return false;
+}
 
 // Parse an HTTP method.
 result<http_method> parse_method(std::string_view method) noexcept {
@@ -157,9 +210,13 @@ result<request_line> parse_request_line(std::string_view line) noexcept {
   if (method.failure()) return error{std::move(method).status()};
   const char* const uri_begin = method_end + 1;
   const char* const uri_end = std::find(uri_begin, last, ' ');
-  result<uri> uri = parse_uri(std::string_view(uri_begin, uri_end - uri_begin));
+  result<uri_view> uri =
+      parse_uri(std::string_view(uri_begin, uri_end - uri_begin));
   if (uri.failure()) return error{std::move(uri).status()};
-  return request_line{*method, std::move(*uri)};
+  const std::string_view version =
+      uri_end == last ? std::string_view()
+                      : trim(std::string_view(uri_end + 1, last - uri_end - 1));
+  return request_line{*method, *uri, version == "HTTP/1.1"};
 }
 
 struct header {
@@ -167,18 +224,6 @@ struct header {
   std::string_view value;
 };
 
-constexpr bool is_whitespace(char c) noexcept {
-  return c == ' ' || c == '\t' || c == '\r';
-}
-
-std::string_view trim(std::string_view value) noexcept {
-  const char* i = value.data();
-  const char* j = i + value.size();
-  while (i != j && is_whitespace(*i)) ++i;
-  while (j != i && is_whitespace(j[-1])) --j;
-  return std::string_view(i, j - i);
-}
-
 // Parse a single HTTP header from a string_view.
 result<header> parse_header(std::string_view line) noexcept {
   assert(!line.empty());
@@ -202,35 +247,48 @@ result<header> parse_header(std::string_view line) noexcept {
 }
 
 struct request_header : request_line {
-  int content_length;
+  std::size_t content_length;
+  // True if the payload uses chunked transfer encoding, in which case it has
+  // no content length.
+  bool chunked;
+  // True if the connection should stay open after this request.
+  bool keep_alive;
+  http_headers headers;
 };
 
-// Parse a full HTTP request header.
-// TODO: Add support for custom headers.
-result<request_header> parse_request_header(std::string_view header) noexcept {
-  assert(!header.empty());
-  assert(header.back() == '\n');
-  const char* const first = header.data();
-  const char* const last = header.data() + header.size();
-  const char* i = std::find(first, last, '\n');
-  auto request_line = parse_request_line(std::string_view(first, i - first));
+// Parse a full HTTP request header, using the line boundaries which were found
+// by the scanner. The header fields are stored in the provided storage, which
+// must have space for every line of the header.
+result<request_header> parse_request_header(
+    std::string_view input, const header_scanner& scanner,
+    span<http_header_field> fields) noexcept {
+  const span<const std::uint32_t> line_ends = scanner.line_ends();
+  assert(!line_ends.empty());
+  const std::size_t start = scanner.start();
+  auto request_line =
+      parse_request_line(input.substr(start, line_ends[0] - start));
   if (request_line.failure()) return error{std::move(request_line).status()};
-  int content_length = 0;
-  while (true) {
+  // Unsigned, so that from_chars rejects a negative length.
+  std::size_t content_length = 0;
+  bool has_content_length = false;
+  bool chunked = false;
+  bool keep_alive = request_line->persistent;
+  assert(line_ends.size() <= fields.size() + 1);
+  std::size_t num_fields = 0;
+  for (std::size_t i = 1; i < line_ends.size(); i++) {
     // Parse a single `Header-Name: value` pair.
-    const char* const line_start = i + 1;
-    const char* const line_end = std::find(line_start, last, '\n');
+    const std::size_t line_start = line_ends[i - 1] + 1;
     const std::string_view line =
-        trim(std::string_view(line_start, line_end - line_start));
-    if (line.empty()) break;
-    i = line_end;
+        trim(input.substr(line_start, line_ends[i] - line_start));
+    if (line.empty()) {
+      return error{status(http_status::bad_request, "blank header line")};
+    }
     auto header = parse_header(line);
     if (header.failure()) return error{std::move(header).status()};
-    // Header names should be case insensitive, so make the name lowercase.
-    std::string header_name;
-    for (char c : header->name) header_name.push_back(std::tolower(c));
-    // Handle known headers.
-    if (header_name == "content-length") {
+    const http_header id = classify_header(header->name);
+    fields[num_fields++] = http_header_field{id, header->name, header->value};
+    // Handle headers which affect how the request is read.
+    if (id == http_header::content_length) {
       const char* const value_begin = header->value.data();
       const char* const value_end = value_begin + header->value.size();
       const auto [ptr, code] =
@@ -238,96 +296,802 @@ result<request_header> parse_request_header(std::string_view header) noexcept {
       if (ptr != value_end || code != std::errc{}) {
         return error{status(http_status::bad_request, "bad content-length")};
       }
-    } else if (header_name == "transfer-encoding") {
-      // TODO: Implement chunked transfer.
-      return error{http_status::not_implemented};
+      has_content_length = true;
+    } else if (id == http_header::connection) {
+      if (has_token(header->value, "close")) {
+        keep_alive = false;
+      } else if (has_token(header->value, "keep-alive")) {
+        keep_alive = true;
+      }
+    } else if (id == http_header::transfer_encoding) {
+      // Chunked is the only supported transfer coding, and it must be the
+      // only one which was applied.
+      if (!equals_ignore_case(header->value, "chunked")) {
+        return error{status(http_status::not_implemented,
+                            "unsupported transfer-encoding")};
+      }
+      chunked = true;
     }
   }
-  return request_header{std::move(*request_line), content_length};
+  if (chunked && has_content_length) {
+    // A message with both could be framed differently by different parsers,
+    // which is a well known way to smuggle requests past a proxy.
+    return error{status(http_status::bad_request,
+                        "both content-length and transfer-encoding")};
+  }
+  return request_header{std::move(*request_line), content_length, chunked,
+                        keep_alive,
+                        http_headers(span<const http_header_field>(
+                            fields.data(), num_fields))};
 }
 
-struct request : request_line {
-  span<char> payload;
-};
+// Append the status line and headers of a response to the output, including
+// the blank line which marks the end of the header block. This is formatted by
+// hand, since it happens for every response. A response without a content
+// length either uses chunked transfer encoding or ends when the connection is
+// closed.
+void write_response_header(std::string& output, http_status code,
+                           std::string_view content_type,
+                           std::optional<std::size_t> content_length,
+                           bool keep_alive, bool chunked = false) {
+  const auto append_number = [&](std::size_t n) {
+    char digits[20];
+    output.append(digits,
+                  std::to_chars(digits, digits + sizeof(digits), n).ptr);
+  };
+  status_payload payload;
+  payload.code = (int)code;
+  output += "HTTP/1.1 ";
+  append_number((std::size_t)code);
+  output += ' ';
+  output += http_status_manager.domain();
+  output += "::";
+  output += http_status_manager.name(payload);
+  output += "\r\nContent-Type: ";
+  output += content_type;
+  if (content_length) {
+    output += "\r\nContent-Length: ";
+    append_number(*content_length);
+  } else if (chunked) {
+    output += "\r\nTransfer-Encoding: chunked";
+  }
+  output += "\r\nConnection: ";
+  output += keep_alive ? "keep-alive" : "close";
+  output += "\r\n\r\n";
+}
 
-void read_request(tcp::stream& client, span<char> buffer,
-                  std::function<void(result<http_request>)> done) noexcept {
-  read_request_header(
-      client, buffer,
-      [&client, buffer, done = std::move(done)](result<header_data> data) {
-        if (data.failure()) {
-          done(error{std::move(data).status()});
-          return;
-        }
-        auto header = parse_request_header(
-            std::string_view(data->header.data(), data->header.size()));
-        if (header.failure()) {
-          done(error{std::move(header).status()});
-          return;
+// Incrementally removes the framing from a payload sent with chunked transfer
+// encoding. The payload is fed to the decoder as it arrives, and the data of
+// each chunk is returned as a view of the input, so it is never copied. Chunk
+// extensions and trailer fields are skipped. Like the header scanner, this
+// accepts a bare "\n" as a line ending.
+class chunked_decoder {
+ public:
+  struct piece {
+    // The number of bytes of input which were used, including the data.
+    std::size_t consumed;
+    // Payload data from the input, which is empty if the input only contained
+    // framing.
+    span<const char> data;
+  };
+
+  // Decode from the start of the input, stopping after the first run of
+  // payload data or at the end of the payload. Framing is consumed as it is
+  // seen, so any input which is not consumed is either more data or belongs
+  // to whatever follows the payload.
+  result<piece> decode(span<const char> input) noexcept {
+    std::size_t i = 0;
+    while (i < input.size() && state_ != state::done) {
+      if (state_ == state::data) {
+        const std::size_t n =
+            (std::size_t)std::min<std::uint64_t>(remaining_, input.size() - i);
+        remaining_ -= n;
+        if (remaining_ == 0) state_ = state::data_end;
+        return piece{i + n, input.subspan(i, n)};
+      }
+      const char c = input[i++];
+      switch (state_) {
+        case state::size_start:
+        case state::size: {
+          const int digit = hex_digit(c);
+          if (digit >= 0) {
+            // Sizes are limited to 60 bits, which is plenty.
+            if (remaining_ >> 56) return bad_chunk("chunk size is too large");
+            remaining_ = remaining_ << 4 | digit;
+            state_ = state::size;
+          } else if (state_ == state::size_start) {
+            return bad_chunk("missing chunk size");
+          } else if (c == '\r' || c == '\n') {
+            end_line(c, remaining_ ? state::data : state::trailer);
+          } else {
+            // Chunk extensions (and any whitespace before them) are ignored.
+            state_ = state::extension;
+          }
+          break;
         }
-        if (header->content_length > buffer.size()) {
-          done(error{http_status::payload_too_large});
-          return;
+        case state::extension:
+          if (c == '\r' || c == '\n') {
+            end_line(c, remaining_ ? state::data : state::trailer);
+          }
+          break;
+        case state::data_end:
+          if (c != '\r' && c != '\n') return bad_chunk("chunk is too long");
+          end_line(c, state::size_start);
+          break;
+        case state::trailer:
+          if (c == '\r' || c == '\n') {
+            end_line(c, state::done);
+          } else {
+            state_ = state::trailer_field;
+          }
+          break;
+        case state::trailer_field:
+          if (c == '\n') state_ = state::trailer;
+          break;
+        case state::line_feed:
+          if (c != '\n') return bad_chunk("missing line feed");
+          state_ = after_line_;
+          break;
+        case state::data:
+        case state::done:
+          break;
+      }
+    }
+    return piece{i, {}};
+  }
+
+  // True once the whole payload has been decoded.
+  bool done() const noexcept { return state_ == state::done; }
+
+  // Prepare to decode a new payload.
+  void reset() noexcept {
+    state_ = state::size_start;
+    remaining_ = 0;
+  }
+
+ private:
+  enum class state {
+    size_start,     // The first character of a chunk size.
+    size,           // The rest of a chunk size.
+    extension,      // A chunk extension, after the size.
+    data,           // Chunk data, with remaining_ bytes left.
+    data_end,       // The line ending after chunk data.
+    trailer,        // The start of a trailer field, or the final empty line.
+    trailer_field,  // The rest of a trailer field.
+    line_feed,      // The '\n' after a '\r'.
+    done,
+  };
+
+  static int hex_digit(char c) noexcept {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  static error bad_chunk(std::string message) noexcept {
+    return error{status(http_status::bad_request, std::move(message))};
+  }
+
+  // Finish a line which ended with the given character, and then move on to
+  // the given state.
+  void end_line(char c, state next) noexcept {
+    if (c == '\r') {
+      state_ = state::line_feed;
+      after_line_ = next;
+    } else {
+      state_ = next;
+    }
+  }
+
+  state state_ = state::size_start;
+  state after_line_ = state::size_start;
+  std::uint64_t remaining_ = 0;
+};
+
+// A single client connection, which is served by a coroutine. Connections are
+// persistent: once a response has been written, the connection reads the next
+// request unless the client asked for the connection to be closed or the
+// request limit has been reached. Bytes which were read beyond the end of one
+// request are kept as the start of the next, so pipelined requests are handled
+// in order.
+//
+// While a handler is running, the coroutine waits for it to ask for something
+// (a piece of the request body, the response, or a piece of a streamed
+// response) and carries out each request in turn, so that all of the reading
+// and writing for the connection happens in one place.
+struct accept_handler;
+
+class connection final : public detail::http_exchange {
+ public:
+  static void spawn(tcp::stream client,
+                    std::shared_ptr<accept_handler> acceptor) noexcept {
+    util::spawn(serve(std::move(client), std::move(acceptor)));
+  }
+
+  connection(tcp::stream client,
+             std::shared_ptr<accept_handler> acceptor) noexcept;
+  ~connection() noexcept;
+
+ private:
+  // The connection lives in the frame of this coroutine. Every coroutine that
+  // it calls takes the connection's frame pool as its first parameter, so
+  // their frames are recycled from one request to the next.
+  static task<> serve(tcp::stream client,
+                      std::shared_ptr<accept_handler> acceptor) {
+    connection c(std::move(client), std::move(acceptor));
+    co_await c.run(c.frames);
+  }
+
+  // Serve requests until the connection closes.
+  task<> run(frame_pool&) {
+    while (true) {
+      if (bytes_read == 0) {
+        // The connection is idle until the next request starts to arrive, so
+        // its buffers go back to the pool until there is something to read. If
+        // that takes too long, the connection is closed quietly.
+        release_buffers();
+        set_deadline(options.idle_timeout);
+        if (status s = co_await client.await_readable(); s.failure()) {
+          if (!timed_out(s)) std::cerr << s << '\n';
+          co_return;
         }
-        // Read the payload of the request.
-        const auto already_read = std::min<span<char>::size_type>(
-            data->trailing_bytes.size(), header->content_length);
-        std::memmove(buffer.data(), data->trailing_bytes.data(), already_read);
-        const span<char>::size_type remaining =
-            header->content_length - already_read;
-        if (remaining == 0) {
-          // Payload was already received.
-          done(http_request{
-              header->method, std::move(header->target),
-              std::string_view(buffer.data(), header->content_length)});
-        } else {
-          // Read the remainder of the payload.
-          client.read(
-              buffer.subspan(already_read, remaining),
-              [&client, buffer, header = std::move(*header),
-               done = std::move(done)](result<span<char>> payload) mutable {
-                if (payload.success()) {
-                  done(http_request{
-                      header.method, std::move(header.target),
-                      std::string_view(buffer.data(), header.content_length)});
-                } else {
-                  done(error{std::move(payload).status()});
-                }
-              });
+        buffer = pool.acquire(options.initial_buffer_size);
+      }
+      set_deadline(options.header_timeout);
+      if (status s = co_await read_request(frames); s.failure()) {
+        // A request which missed its deadline gets a 408 response, and then
+        // the connection is closed.
+        if (!timed_out(s)) co_return;
+        keep_alive = false;
+        (void)co_await respond(frames,
+                               error{status(http_status::request_timeout)});
+        co_return;
+      }
+      cancel_deadline();
+      if (status s = co_await dispatch(frames); s.failure()) co_return;
+      if (!keep_alive) co_return;
+      next_request();
+    }
+  }
+
+  // Read a complete request into the buffer, with the payload immediately
+  // after the header. Any bytes which are already in the buffer are scanned
+  // before reading more. On failure, the connection should be closed: a
+  // failure with std::errc::timed_out means that the client missed a
+  // deadline, and anything else has already been reported.
+  task<status> read_request(frame_pool&) {
+    while (true) {
+      // Scan for the end of the header. The scanner remembers where it got
+      // to, so only the new bytes are examined.
+      const auto scan =
+          scanner.scan(std::string_view(buffer.data(), bytes_read));
+      if (scan == header_scanner::scan_result::complete) break;
+      if (scan == header_scanner::scan_result::too_many_lines) {
+        co_return report(status(http_status::request_header_fields_too_large));
+      }
+      // Read more input into the free space at the end of the buffer, growing
+      // the buffer first if it is full.
+      if (bytes_read == buffer.size()) {
+        if (buffer.size() >= options.max_request_size) {
+          co_return report(
+              status(http_status::request_header_fields_too_large));
         }
-      });
-}
-
-// TODO: Implement `Connection: keep-alive`, where the same connection can be
-// reused for subsequent requests. This will require smarter handling of the
-// request reading since currently we may read beyond the end of the request
-// payload and then discard those trailing bytes.
-struct connection {
-  static void spawn(tcp::stream client, const handler_map& handlers) noexcept {
-    auto self = std::make_shared<connection>(std::move(client), handlers);
-    read_request(self->client, self->buffer, [self](result<http_request> r) {
-      if (r.success()) {
-        r->respond = [self](result<http_response> response) {
-          self->respond(self, std::move(response));
-        };
-        auto handler = self->handlers.find(r->target.path);
-        if (handler == self->handlers.end()) {
-          r->respond(error{status(http_status::not_found,
-                                  "no handler for " + r->target.path)});
-        } else {
-          handler->second(std::move(*r));
+        grow(std::min(4 * buffer.size(), options.max_request_size));
+      }
+      result<span<char>> bytes =
+          co_await client.read_some(span<char>(buffer).subspan(bytes_read));
+      if (bytes.failure()) {
+        co_return report_read_error(std::move(bytes).status());
+      }
+      // Running out of input is only an error in the middle of a request.
+      if (bytes->empty()) {
+        if (bytes_read > 0) std::cerr << "Incomplete request header\n";
+        co_return error{std::errc::connection_aborted};
+      }
+      bytes_read += bytes->size();
+    }
+    header_size = scanner.size();
+    // Parse the header and read the rest of the payload.
+    if (status s = parse_header(); s.failure()) co_return report(std::move(s));
+    if (request.chunked) {
+      // The payload is read as the handler asks for it, into the space after
+      // the header, so there must be a reasonable amount of space there.
+      if (buffer.size() - header_size < options.initial_buffer_size / 2) {
+        grow(header_size + options.initial_buffer_size);
+        if (status s = parse_header(); s.failure()) {
+          co_return report(std::move(s));
         }
-      } else {
-        std::cerr << r.status() << '\n';
       }
-    });
+      co_return status_code::ok;
+    }
+    // The length is checked before it is added to the header size, so that a
+    // huge value cannot wrap around.
+    const std::size_t content_length = request.content_length;
+    if (header_size > options.max_request_size ||
+        content_length > options.max_request_size - header_size) {
+      co_return report(status(http_status::payload_too_large));
+    }
+    const std::size_t request_size = header_size + content_length;
+    if (request_size > buffer.size()) {
+      // The parsed header refers to the buffer, so it must be parsed again
+      // once the buffer has moved.
+      grow(request_size);
+      if (status s = parse_header(); s.failure()) {
+        co_return report(std::move(s));
+      }
+    }
+    // Any bytes after the header which have already been read are the start of
+    // the payload.
+    if (bytes_read < request_size) set_deadline(options.payload_timeout);
+    while (bytes_read < request_size) {
+      result<span<char>> bytes = co_await client.read_some(
+          span<char>(buffer.data() + bytes_read, request_size - bytes_read));
+      if (bytes.failure()) {
+        co_return report_read_error(std::move(bytes).status());
+      }
+      if (bytes->empty()) {
+        std::cerr << "Incomplete request payload\n";
+        co_return error{std::errc::connection_aborted};
+      }
+      bytes_read += bytes->size();
+    }
+    co_return status_code::ok;
+  }
+
+  // Pass a fully received request to the appropriate handler, and send the
+  // response.
+  task<status> dispatch(frame_pool&) {
+    requests_served++;
+    keep_alive = request.keep_alive &&
+                 (options.max_requests_per_connection <= 0 ||
+                  requests_served < options.max_requests_per_connection);
+    // Routes are matched against the decoded path, but the path is only
+    // decoded if it actually contains escape sequences.
+    std::string decoded_path;
+    std::string_view path = request.target.path;
+    if (path.find('%') != std::string_view::npos) {
+      result<std::string> decoded = percent_decode(path);
+      if (decoded.failure()) {
+        co_return co_await respond(frames,
+                                   error{std::move(decoded).status()});
+      }
+      decoded_path = std::move(*decoded);
+      path = decoded_path;
+    }
+    auto websocket_handler = websocket_handlers.find(path);
+    if (websocket_handler != websocket_handlers.end()) {
+      co_return co_await upgrade(frames, websocket_handler->second);
+    }
+    auto static_response = static_responses.find(path);
+    if (static_response != static_responses.end()) {
+      co_return co_await respond(frames, static_response->second);
+    }
+    auto handler = handlers.find(path);
+    if (handler == handlers.end()) {
+      co_return co_await respond(
+          frames, error{status(http_status::not_found,
+                               "no handler for " + std::string(path))});
+    }
+    // The handler may ask for things at any point, from any task on this
+    // context, until its response has been sent.
+    reply = reply_state::waiting;
+    stream_end = stream_state::open;
+    response.reset();
+    body_begin = header_size;
+    body_delivered = false;
+    body_failed = false;
+    decoder.reset();
+    handler->second(http_request{
+        request.method, request.target, request.headers,
+        request.chunked ? std::string_view()
+                        : std::string_view(buffer.data() + header_size,
+                                           request.content_length),
+        http_body(*this), http_responder(*this)});
+    co_return co_await serve_handler(frames);
+  }
+
+  // Complete a websocket handshake (RFC 6455 section 4.2) and hand the stream
+  // over to the handler. The connection ends here, but it still counts towards
+  // the connection limit until the websocket is destroyed.
+  task<status> upgrade(frame_pool&,
+                       const http_server::websocket_handler& handler) {
+    if (status s = check_upgrade(); s.failure()) {
+      co_return co_await respond(frames, error{std::move(s)});
+    }
+    output.clear();
+    output +=
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: ";
+    output += websocket_accept_key(
+        *request.headers.get(http_header::sec_websocket_key));
+    output += "\r\n\r\n";
+    output_buffers = {output};
+    if (status s = co_await write_output(frames); s.failure()) co_return s;
+    // Clients must wait for the handshake to complete before sending frames,
+    // but any that arrived early are passed on.
+    keep_alive = false;
+    const span<const char> leftover(buffer.data() + header_size,
+                                    bytes_read - header_size);
+    handler(make_websocket(leftover));
+    co_return status_code::ok;
+  }
+
+  // Move the stream into a websocket, which takes over the connection's place
+  // in the count of open connections.
+  websocket make_websocket(span<const char> buffered) noexcept;
+
+  // Check that the request is a websocket handshake which we can accept.
+  status check_upgrade() const noexcept {
+    const http_headers& headers = request.headers;
+    const auto upgrade = headers.get(http_header::upgrade);
+    const auto connection = headers.get(http_header::connection);
+    if (!upgrade || !has_token(*upgrade, "websocket") || !connection ||
+        !has_token(*connection, "upgrade")) {
+      return status(http_status::upgrade_required, "expected a websocket");
+    }
+    if (headers.get(http_header::sec_websocket_version) != "13") {
+      return status(http_status::upgrade_required,
+                    "unsupported websocket version");
+    }
+    // The key is 16 bytes in base64.
+    const auto key = headers.get(http_header::sec_websocket_key);
+    if (request.method != http_method::get || !key || key->size() != 24 ||
+        request.chunked || request.content_length != 0) {
+      return status(http_status::bad_request, "bad websocket handshake");
+    }
+    return status_code::ok;
+  }
+
+  // Carry out the handler's requests until it has responded, and then send
+  // the response.
+  task<status> serve_handler(frame_pool&) {
+    while (true) {
+      co_await handler_event{*this, reply_state::waiting};
+      if (body_reader) {
+        co_await serve_body_read(frames);
+        continue;
+      }
+      if (reply == reply_state::waiting) continue;
+      // A connection cannot be reused unless the whole request was read, and
+      // the response header has to say so.
+      if (!body_complete()) keep_alive = false;
+      if (reply == reply_state::streaming) {
+        co_return co_await stream_response(frames);
+      }
+      co_return co_await respond(frames, std::move(*response));
+    }
+  }
+
+  // Send a response whose body the handler writes a piece at a time, with
+  // each piece as a chunk.
+  task<status> stream_response(frame_pool&) {
+    // A client which does not speak HTTP/1.1 cannot decode chunks, so the end
+    // of the body is marked by closing the connection instead.
+    chunked_response = request.persistent;
+    if (!chunked_response) keep_alive = false;
+    // The header is sent along with the first chunk.
+    output.clear();
+    write_response_header(output, http_status::ok, stream_content_type,
+                          std::nullopt, keep_alive, chunked_response);
+    bool failed = false;
+    while (true) {
+      co_await handler_event{*this, reply_state::streaming};
+      if (body_reader) {
+        co_await serve_body_read(frames);
+      } else if (chunk_writer) {
+        // Once a write has failed, the rest of the body is discarded.
+        status s = failed ? status(std::errc::connection_aborted)
+                   : chunk.empty() ? status(status_code::ok)
+                                   : co_await write_chunk(frames);
+        failed = s.failure();
+        std::exchange(chunk_writer, nullptr)(std::move(s));
+      } else if (stream_end == stream_state::aborted) {
+        co_return report(status(std::errc::connection_aborted,
+                                "handler abandoned its response"));
+      } else if (stream_end == stream_state::finished) {
+        if (failed) co_return error{std::errc::connection_aborted};
+        if (chunked_response) output += "0\r\n\r\n";
+        output_buffers = {output};
+        co_return co_await write_output(frames);
+      }
+    }
+  }
+
+  // Write one piece of a streamed response, along with the header if it has
+  // not been sent yet.
+  task<status> write_chunk(frame_pool&) {
+    static constexpr std::string_view crlf = "\r\n";
+    if (chunked_response) {
+      char digits[16];
+      output.append(digits,
+                    std::to_chars(digits, digits + sizeof(digits),
+                                  chunk.size(), 16).ptr);
+      output += crlf;
+      output_buffers = {output, chunk, crlf};
+    } else {
+      output_buffers = {output, chunk};
+    }
+    status s = co_await write_output(frames);
+    output.clear();
+    co_return s;
+  }
+
+  // Read the next part of the request body, and pass it to the handler.
+  task<> serve_body_read(frame_pool&) {
+    auto done = std::exchange(body_reader, nullptr);
+    done(co_await read_body_piece(frames));
+  }
+
+  // Read the next part of the request body. A chunked body is decoded in the
+  // space after the header, which is reused once the handler has seen each
+  // piece of it.
+  task<result<span<const char>>> read_body_piece(frame_pool&) {
+    if (!request.chunked) {
+      // The whole body has already been read.
+      if (std::exchange(body_delivered, true)) co_return span<const char>();
+      co_return span<const char>(buffer.data() + header_size,
+                                 request.content_length);
+    }
+    if (body_failed) {
+      co_return error{
+          status(http_status::bad_request, "request body is incomplete")};
+    }
+    while (true) {
+      result<chunked_decoder::piece> piece =
+          decoder.decode(span<const char>(buffer.data() + body_begin,
+                                          bytes_read - body_begin));
+      if (piece.failure()) co_return fail_body(std::move(piece).status());
+      body_begin += piece->consumed;
+      if (!piece->data.empty() || decoder.done()) co_return piece->data;
+      // Everything which was read has been used, so the space after the
+      // header is free again.
+      body_begin = bytes_read = header_size;
+      set_deadline(options.payload_timeout);
+      result<span<char>> bytes =
+          co_await client.read_some(span<char>(buffer).subspan(bytes_read));
+      cancel_deadline();
+      if (bytes.failure()) {
+        status s = report_read_error(std::move(bytes).status());
+        if (timed_out(s)) s = http_status::request_timeout;
+        co_return fail_body(std::move(s));
+      }
+      if (bytes->empty()) {
+        co_return fail_body(
+            status(http_status::bad_request, "incomplete request payload"));
+      }
+      bytes_read += bytes->size();
+    }
+  }
+
+  // Give up on reading the request body. The handler can still respond, but
+  // the connection will be closed afterwards.
+  error fail_body(status s) noexcept {
+    body_failed = true;
+    return error{std::move(s)};
+  }
+
+  bool body_complete() const noexcept {
+    return !request.chunked || decoder.done();
+  }
+
+  // The handler's side of the exchange. Each of these records what the
+  // handler has asked for, and then resumes the coroutine if it is waiting
+  // for the handler. This must come last, since the connection may have been
+  // destroyed by the time the coroutine suspends again.
+  void read_body(unique_function<void(result<span<const char>>)> done) noexcept
+      override {
+    assert(!body_reader);
+    body_reader = std::move(done);
+    wake();
+  }
+
+  void respond(result<http_response> r) noexcept override {
+    assert(reply == reply_state::waiting);
+    response.emplace(std::move(r));
+    reply = reply_state::complete;
+    wake();
+  }
+
+  void start_stream(std::string content_type) noexcept override {
+    assert(reply == reply_state::waiting);
+    stream_content_type = std::move(content_type);
+    reply = reply_state::streaming;
+    wake();
+  }
+
+  void write_chunk(span<const char> data,
+                   unique_function<void(status)> done) noexcept override {
+    assert(reply == reply_state::streaming && !chunk_writer);
+    chunk = data;
+    chunk_writer = std::move(done);
+    wake();
+  }
+
+  void finish_stream(bool complete) noexcept override {
+    assert(reply == reply_state::streaming);
+    stream_end = complete ? stream_state::finished : stream_state::aborted;
+    wake();
   }
 
-  connection(tcp::stream client, const handler_map& handlers) noexcept
-      : client(std::move(client)), handlers(handlers) {}
+  void wake() noexcept {
+    if (waiting) std::exchange(waiting, nullptr).resume();
+  }
+
+  enum class reply_state { waiting, complete, streaming };
+  enum class stream_state { open, finished, aborted };
+
+  // Suspends the coroutine until the handler asks for something which it has
+  // not already seen.
+  struct handler_event {
+    connection& c;
+    reply_state seen;
+    bool await_ready() const noexcept {
+      return c.body_reader || c.chunk_writer || c.reply != seen ||
+             c.stream_end != stream_state::open;
+    }
+    void await_suspend(std::coroutine_handle<> h) noexcept { c.waiting = h; }
+    void await_resume() const noexcept {}
+  };
+
+  task<status> respond(frame_pool&, result<http_response> r) {
+    if (r.failure()) {
+      co_return co_await respond(frames, error{std::move(r).status()});
+    }
+    output.clear();
+    write_response_header(output, code(r.status()), r->content_type,
+                          r->file.handle != file_handle::none
+                              ? r->file.size
+                              : r->payload.size(),
+                          keep_alive);
+    if (r->file.handle != file_handle::none) {
+      co_return report_write_error(
+          co_await client.send_file(output, r->file));
+    }
+    // The header and the payload are gathered into a single write so that the
+    // payload does not need to be copied.
+    output_buffers = {output, r->payload};
+    co_return co_await write_output(frames);
+  }
+
+  // Send a prebuilt response. The header and the payload are sent together
+  // with a single gather write, without formatting or copying either of them.
+  task<status> respond(frame_pool&, const http_static_response& r) {
+    const std::string& header =
+        keep_alive ? r.keep_alive_header : r.close_header;
+    if (r.file.handle != file_handle::none) {
+      co_return report_write_error(co_await client.send_file(header, r.file));
+    }
+    output_buffers = {header, r.payload};
+    co_return co_await write_output(frames);
+  }
+
+  task<status> respond(frame_pool&, error e) {
+    std::ostringstream body_stream;
+    body_stream << e;
+    const std::string body = std::move(body_stream).str();
+    output.clear();
+    write_response_header(output, code(e), "text/plain", body.size(),
+                          keep_alive);
+    output += body;
+    output_buffers = {output, {}};
+    co_return co_await write_output(frames);
+  }
+
+  // Write everything in the output buffers, gathering as much as possible
+  // into each system call.
+  task<status> write_output(frame_pool&) {
+    span<span<const char>> remaining = output_buffers;
+    while (true) {
+      // Skip over empty buffers so that every write makes progress.
+      while (!remaining.empty() && remaining[0].empty()) {
+        remaining = remaining.subspan(1);
+      }
+      if (remaining.empty()) co_return status_code::ok;
+      result<std::size_t> written =
+          co_await client.write_some(span<const span<const char>>(remaining));
+      if (written.failure()) {
+        co_return report_write_error(std::move(written).status());
+      }
+      // Skip past whatever was written.
+      std::size_t n = *written;
+      for (span<const char>& b : remaining) {
+        const std::size_t step = std::min(n, b.size());
+        b = b.subspan(step);
+        n -= step;
+      }
+    }
+  }
+
+  // Move any bytes of the next request to the start of the buffer, so that
+  // they are scanned as if they had just been read.
+  void next_request() noexcept {
+    const std::size_t request_size =
+        request.chunked ? body_begin : header_size + request.content_length;
+    const std::size_t leftover = bytes_read - request_size;
+    std::memmove(buffer.data(), buffer.data() + request_size, leftover);
+    bytes_read = leftover;
+    header_size = 0;
+    scanner.reset();
+  }
+
+  // Make the pending read fail with std::errc::timed_out if it does not
+  // complete within the given time. This replaces any previous deadline.
+  void set_deadline(executor::duration timeout) noexcept {
+    cancel_deadline();
+    deadline = client.context().schedule_in(
+        timeout, [this] { client.cancel_read(std::errc::timed_out); });
+  }
+
+  // Stop enforcing the deadline. If it passed just as the read completed, the
+  // cancellation would otherwise apply to the next read, which has a deadline
+  // of its own.
+  void cancel_deadline() noexcept {
+    deadline.cancel();
+    client.clear_cancel_read();
+  }
+
+  // Returns true if the status is the failure of a read which missed its
+  // deadline. This has to compare the domain, since statuses from different
+  // domains are compared by their canonical codes, and every posix error
+  // (like every 5xx status) is canonically an unknown error.
+  static bool timed_out(const status& s) noexcept {
+    const status timeout = std::errc::timed_out;
+    return s.domain() == timeout.domain() && s.code() == timeout.code();
+  }
+
+  // Report a problem with the request, which means that the connection will
+  // be closed.
+  static status report(status s) noexcept {
+    std::cerr << s << '\n';
+    return s;
+  }
+  static status report_read_error(status s) noexcept {
+    if (!timed_out(s)) std::cerr << s << '\n';
+    return s;
+  }
+  static status report_write_error(status s) noexcept {
+    if (s.failure()) std::cerr << "Error responding to client: " << s << '\n';
+    return s;
+  }
+
+  // Parse the request header in the buffer. The header fields are stored in a
+  // buffer from the pool.
+  status parse_header() noexcept {
+    const std::size_t num_lines = scanner.line_ends().size();
+    const std::size_t fields_size = num_lines * sizeof(http_header_field);
+    if (fields_buffer.size() < fields_size) {
+      fields_buffer = pool.acquire(fields_size);
+    }
+    auto* const fields =
+        reinterpret_cast<http_header_field*>(fields_buffer.data());
+    std::uninitialized_default_construct_n(fields, num_lines);
+    auto header = parse_request_header(
+        std::string_view(buffer.data(), header_size), scanner,
+        span<http_header_field>(fields, num_lines));
+    if (header.failure()) return std::move(header).status();
+    request = std::move(*header);
+    return status_code::ok;
+  }
+
+  // Move the buffered input into a buffer of at least the given size.
+  void grow(std::size_t size) noexcept {
+    buffer_pool::buffer larger = pool.acquire(size);
+    std::memcpy(larger.data(), buffer.data(), bytes_read);
+    buffer = std::move(larger);
+  }
+
+  // Return the per-request buffers while the connection is idle. The response
+  // header is small, so it keeps its memory.
+  void release_buffers() noexcept {
+    buffer.reset();
+    fields_buffer.reset();
+  }
 
   static http_status code(const status& s) noexcept {
-    if (s.domain().domain() == "http") return http_status{s.code()};
+    if (s.domain().domain() == "http_status") return http_status{s.code()};
     switch (status_code{s.canonical().code()}) {
       case status_code::ok:
         return http_status::ok;
@@ -346,90 +1110,189 @@ struct connection {
     }
   }
 
-  void respond(std::shared_ptr<connection> self, status s,
-               const http_response& r) noexcept {
-    std::ostringstream output_stream;
-    http_status h = code(s);
-    output_stream << "HTTP/1.1 " << (int)h << ' ' << status(h)
-                  << "\r\n"
-                     "Content-Type: "
-                  << r.content_type
-                  << "\r\n"
-                     "Content-Length: "
-                  << r.payload.size()
-                  << "\r\n"
-                     "\r\n"
-                  << r.payload;
-    output = std::move(output_stream).str();
-    client.write(output, [self](status s) {
-      if (s.failure()) {
-        std::cerr << "Error responding to client: " << s << '\n';
-      }
-    });
-  }
-
-  void respond(std::shared_ptr<connection> self, error e) noexcept {
-    const http_status c = code(e);
-    std::ostringstream body_stream;
-    body_stream << e;
-    std::string body = std::move(body_stream).str();
-    std::ostringstream output_stream;
-    output_stream << "HTTP/1.1 " << (int)c << " " << status(c)
-                  << "\r\n"
-                     "Content-Type: text/plain\r\n"
-                     "Content-Length: "
-                  << body.size()
-                  << "\r\n"
-                     "\r\n"
-                  << body;
-    output = std::move(output_stream).str();
-    client.write(output, [self](status s) {
-      if (s.failure()) {
-        std::cerr << s << '\n';
-      }
-    });
-  }
-
-  void respond(std::shared_ptr<connection> self,
-               result<http_response> r) noexcept {
-    if (r.success()) {
-      respond(std::move(self), std::move(r).status(), std::move(*r));
-    } else {
-      respond(std::move(self), error{std::move(r).status()});
-    }
-  }
-
   tcp::stream client;
+  std::shared_ptr<accept_handler> acceptor;
+  buffer_pool& pool;
   const handler_map& handlers;
-  char buffer[65536];
+  const static_response_map& static_responses;
+  const websocket_handler_map& websocket_handlers;
+  const http_options& options;
+  frame_pool frames;
+  executor::timer deadline;
+  request_header request;
+  int requests_served = 0;
+  bool keep_alive = false;
+  std::size_t bytes_read = 0;
+  std::size_t header_size = 0;
+  header_scanner scanner;
+  buffer_pool::buffer fields_buffer;
+  buffer_pool::buffer buffer;
   std::string output;
+  std::array<span<const char>, 3> output_buffers;
+  // The state of the exchange with the handler for the current request.
+  std::coroutine_handle<> waiting;
+  reply_state reply = reply_state::waiting;
+  stream_state stream_end = stream_state::open;
+  std::optional<result<http_response>> response;
+  std::string stream_content_type;
+  bool chunked_response = false;
+  span<const char> chunk;
+  unique_function<void(status)> chunk_writer;
+  unique_function<void(result<span<const char>>)> body_reader;
+  // How much of a chunked body has been decoded, as an offset in the buffer.
+  std::size_t body_begin = 0;
+  bool body_delivered = false;
+  bool body_failed = false;
+  chunked_decoder decoder;
 };
 
+// Accepts connections for one context and keeps count of how many of them are
+// open, so that it can stop accepting while the context is at its connection
+// limit. Each connection holds a reference to the handler so that it can
+// report when it closes.
 struct accept_handler {
-  static void spawn(tcp::acceptor& server,
-                    const handler_map& handlers) noexcept {
-    auto self = std::make_shared<accept_handler>(server, handlers);
+  static void spawn(tcp::acceptor& server, buffer_pool& pool,
+                    const handler_map& handlers,
+                    const static_response_map& static_responses,
+                    const websocket_handler_map& websocket_handlers,
+                    const http_options& options) noexcept {
+    auto self = std::make_shared<accept_handler>(
+        server, pool, handlers, static_responses, websocket_handlers, options);
     self->do_accept(self);
   }
 
-  accept_handler(tcp::acceptor& server, const handler_map& handlers) noexcept
-      : server(server), handlers(handlers) {}
+  accept_handler(tcp::acceptor& server, buffer_pool& pool,
+                 const handler_map& handlers,
+                 const static_response_map& static_responses,
+                 const websocket_handler_map& websocket_handlers,
+                 const http_options& options) noexcept
+      : server(server),
+        pool(pool),
+        handlers(handlers),
+        static_responses(static_responses),
+        websocket_handlers(websocket_handlers),
+        options(options) {}
 
+  // Wait for the next connection, unless the context is at its limit.
   void do_accept(std::shared_ptr<accept_handler> self) noexcept {
-    server.accept([self](result<tcp::stream> client) {
+    if (active_connections >= options.max_connections) {
+      // Accepting resumes when a connection closes.
+      paused = true;
+      return;
+    }
+    server.accept([self](result<tcp::stream> client) mutable {
+      accept_handler& h = *self;
+      h.on_accept(std::move(self), std::move(client));
+    });
+  }
+
+  // Handle an accepted connection, and then take any other connections which
+  // are already waiting, up to the batch limit.
+  void on_accept(std::shared_ptr<accept_handler> self,
+                 result<tcp::stream> client) noexcept {
+    for (int i = 1;; i++) {
       if (client.failure()) {
-        std::cerr << client.status() << '\n';
-      } else {
-        connection::spawn(std::move(*client), self->handlers);
-        self->do_accept(self);
+        on_error(std::move(self), client.status());
+        return;
+      }
+      active_connections++;
+      connection::spawn(std::move(*client), self);
+      if (i >= options.accept_batch ||
+          active_connections >= options.max_connections) {
+        break;
       }
+      client = server.try_accept();
+      if (client.failure() &&
+          client.status() == std::errc::resource_unavailable_try_again) {
+        do_accept(std::move(self));
+        return;
+      }
+    }
+    // Let other work run before accepting any more.
+    server.context().schedule([self = std::move(self)]() mutable {
+      accept_handler& h = *self;
+      h.do_accept(std::move(self));
+    });
+  }
+
+  void on_error(std::shared_ptr<accept_handler> self,
+                const status& s) noexcept {
+    std::cerr << "Cannot accept connection: " << s << '\n';
+    if (s == std::errc::too_many_files_open ||
+        s == std::errc::too_many_files_open_in_system ||
+        s == std::errc::no_buffer_space ||
+        s == std::errc::not_enough_memory) {
+      // The process is out of resources. Back off until either a connection
+      // closes or the retry delay passes.
+      paused = true;
+      retry_timer = server.context().schedule_in(
+          options.accept_retry_delay, [self]() mutable {
+            accept_handler& h = *self;
+            h.paused = false;
+            h.do_accept(std::move(self));
+          });
+      return;
+    }
+    if (s == std::errc::bad_file_descriptor ||
+        s == std::errc::invalid_argument ||
+        s == std::errc::not_a_socket) {
+      // The listening socket itself is broken.
+      std::cerr << "No longer accepting connections.\n";
+      return;
+    }
+    // Anything else (such as a connection which was reset before it could be
+    // accepted) only affects a single connection.
+    do_accept(std::move(self));
+  }
+
+  // Called by each connection as it closes.
+  void on_close(const std::shared_ptr<accept_handler>& self) noexcept {
+    active_connections--;
+    if (!paused) return;
+    paused = false;
+    retry_timer.cancel();
+    // The closing connection is still being destroyed, so accepting resumes
+    // from a fresh task.
+    server.context().schedule([self]() mutable {
+      accept_handler& h = *self;
+      h.do_accept(std::move(self));
     });
   }
 
   tcp::acceptor& server;
+  buffer_pool& pool;
   const handler_map& handlers;
+  const static_response_map& static_responses;
+  const websocket_handler_map& websocket_handlers;
+  const http_options& options;
+  int active_connections = 0;
+  bool paused = false;
+  executor::timer retry_timer;
 };
 
+connection::connection(tcp::stream client,
+                       std::shared_ptr<accept_handler> acceptor) noexcept
+    : client(std::move(client)),
+      acceptor(std::move(acceptor)),
+      pool(this->acceptor->pool),
+      handlers(this->acceptor->handlers),
+      static_responses(this->acceptor->static_responses),
+      websocket_handlers(this->acceptor->websocket_handlers),
+      options(this->acceptor->options) {}
+
+websocket connection::make_websocket(span<const char> buffered) noexcept {
+  return websocket(
+      std::move(client), buffered,
+      [acceptor = std::move(acceptor)] { acceptor->on_close(acceptor); },
+      options.websocket_idle_timeout);
+}
+
+connection::~connection() noexcept {
+  deadline.cancel();
+  // An upgraded connection passes its acceptor on to the websocket.
+  if (acceptor) acceptor->on_close(acceptor);
+}
+
 }  // namespace
 
 status make_status(http_status code) noexcept {
@@ -440,6 +1303,80 @@ status make_status(http_status code, std::string message) noexcept {
   return http_status_with_message_manager.make(code, std::move(message));
 }
 
+http_header classify_header(std::string_view name) noexcept {
+  const http_header candidate = header_table[header_hash(name)];
+  if (candidate != http_header::unknown &&
+      equals_ignore_case(name, known_header_names[(std::size_t)candidate])) {
+    return candidate;
+  }
+  return http_header::unknown;
+}
+
+std::optional<std::string_view> http_headers::get(
+    http_header id) const noexcept {
+  assert(id != http_header::unknown);
+  for (const http_header_field& field : fields_) {
+    if (field.id == id) return field.value;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string_view> http_headers::get(
+    std::string_view name) const noexcept {
+  // Well-known headers can be found by id without comparing any strings.
+  const http_header id = classify_header(name);
+  if (id != http_header::unknown) return get(id);
+  for (const http_header_field& field : fields_) {
+    if (field.id == http_header::unknown &&
+        equals_ignore_case(field.name, name)) {
+      return field.value;
+    }
+  }
+  return std::nullopt;
+}
+
+http_response_writer::~http_response_writer() noexcept {
+  if (exchange_) exchange_->finish_stream(false);
+}
+
+http_response_writer& http_response_writer::operator=(
+    http_response_writer&& other) noexcept {
+  if (this == &other) return *this;
+  if (exchange_) exchange_->finish_stream(false);
+  exchange_ = std::exchange(other.exchange_, nullptr);
+  return *this;
+}
+
+void http_response_writer::finish() noexcept {
+  std::exchange(exchange_, nullptr)->finish_stream(true);
+}
+
+http_responder::~http_responder() noexcept {
+  if (!exchange_) return;
+  exchange_->respond(error{
+      status(http_status::internal_server_error, "handler did not respond")});
+}
+
+http_responder& http_responder::operator=(http_responder&& other) noexcept {
+  if (this == &other) return *this;
+  if (exchange_) {
+    exchange_->respond(error{status(http_status::internal_server_error,
+                                    "handler did not respond")});
+  }
+  exchange_ = std::exchange(other.exchange_, nullptr);
+  return *this;
+}
+
+void http_responder::operator()(result<http_response> response) noexcept {
+  std::exchange(exchange_, nullptr)->respond(std::move(response));
+}
+
+http_response_writer http_responder::stream(std::string content_type) noexcept {
+  detail::http_exchange& exchange = *std::exchange(exchange_, nullptr);
+  exchange.start_stream(std::move(content_type));
+  return http_response_writer(exchange);
+}
+
 std::ostream& operator<<(std::ostream& output, http_method method) noexcept {
   switch (method) {
     case http_method::get: return output << "GET";
@@ -448,33 +1385,106 @@ std::ostream& operator<<(std::ostream& output, http_method method) noexcept {
   return output << "<unknown method>";
 }
 
-result<uri> parse_uri(std::string_view input) noexcept {
-  // TODO: Determine if std::regex is good enough. If not, replace this with
-  // a hand-coded implementation.
-  static const std::regex pattern(
-      R"(^(([^:/?#]+):)?(//([^/?#]*))?([^?#]*)(\?([^#]*))?(#(.*))?)",
-      std::regex_constants::optimize | std::regex_constants::extended);
-  std::cmatch match;
-  if (!std::regex_match(input.data(), input.data() + input.size(), match,
-                        pattern)) {
-    return error{status(http_status::bad_request, "cannot parse URI")};
+result<uri_view> parse_uri(std::string_view input) noexcept {
+  // This is a single pass over the input which matches exactly the same
+  // strings as the regular expression from RFC 3986 appendix B:
+  //
+  //   ^(([^:/?#]+):)?(//([^/?#]*))?([^?#]*)(\?([^#]*))?(#(.*))?
+  //
+  // Each component ends at the first character which cannot be part of it,
+  // so no backtracking is ever required.
+  constexpr auto npos = std::string_view::npos;
+  uri_view result;
+  std::string_view rest = input;
+  // The scheme is a non-empty prefix ending in ':', without any of "/?#".
+  const std::size_t scheme_end = rest.find_first_of(":/?#");
+  if (scheme_end != npos && scheme_end > 0 && rest[scheme_end] == ':') {
+    result.scheme = rest.substr(0, scheme_end);
+    rest.remove_prefix(scheme_end + 1);
+  }
+  if (rest.substr(0, 2) == "//") {
+    rest.remove_prefix(2);
+    const std::size_t authority_end = std::min(rest.find_first_of("/?#"),
+                                               rest.size());
+    result.authority = rest.substr(0, authority_end);
+    rest.remove_prefix(authority_end);
+  }
+  const std::size_t path_end = std::min(rest.find_first_of("?#"), rest.size());
+  result.path = rest.substr(0, path_end);
+  rest.remove_prefix(path_end);
+  if (!rest.empty() && rest.front() == '?') {
+    rest.remove_prefix(1);
+    const std::size_t query_end = std::min(rest.find('#'), rest.size());
+    result.query = rest.substr(0, query_end);
+    rest.remove_prefix(query_end);
+  }
+  if (!rest.empty()) {
+    // The fragment is matched by `.*`, which (in POSIX mode) matches any
+    // character other than NUL.
+    result.fragment = rest.substr(1);
+    if (result.fragment.find('\0') != npos) {
+      return error{status(http_status::bad_request, "cannot parse URI")};
+    }
   }
-  return uri{match[2], match[4], match[5], match[7], match[9]};
+  return result;
+}
+
+result<std::string> percent_decode(std::string_view input) noexcept {
+  const auto hex_value = [](char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+  std::string output;
+  output.reserve(input.size());
+  for (std::size_t i = 0, n = input.size(); i < n; i++) {
+    if (input[i] != '%') {
+      output.push_back(input[i]);
+      continue;
+    }
+    const int high = i + 1 < n ? hex_value(input[i + 1]) : -1;
+    const int low = i + 2 < n ? hex_value(input[i + 2]) : -1;
+    if (high == -1 || low == -1) {
+      return error{status(http_status::bad_request, "bad percent encoding")};
+    }
+    output.push_back((char)(high << 4 | low));
+    i += 2;
+  }
+  return output;
 }
 
 result<http_server> http_server::create(io_context& context,
-                                        const address& address) noexcept {
+                                        const address& address,
+                                        const http_options& options) noexcept {
   http_server server(context);
-  if (status s = server.init(address); s.failure()) return error{std::move(s)};
+  if (status s = server.init(address, options); s.failure()) {
+    return error{std::move(s)};
+  }
   return server;
 }
 
-http_server::http_server(io_context& context) noexcept : context_(&context) {}
+http_server::http_server(io_context& context) noexcept
+    : contexts_(&context, 1) {}
+
+http_server::http_server(span<io_context> contexts) noexcept
+    : contexts_(contexts) {}
 
-status http_server::init(const address& address) noexcept {
-  result<tcp::acceptor> acceptor = tcp::bind(*context_, address);
-  if (acceptor.failure()) return error{std::move(acceptor).status()};
-  acceptor_ = std::move(*acceptor);
+status http_server::init(const address& address,
+                         const http_options& options) noexcept {
+  tcp::bind_options bind_options;
+  bind_options.reuse_port = contexts_.size() > 1;
+  bind_options.backlog = options.backlog;
+  std::vector<tcp::acceptor> acceptors;
+  acceptors.reserve(contexts_.size());
+  for (io_context& context : contexts_) {
+    result<tcp::acceptor> acceptor = tcp::bind(context, address, bind_options);
+    if (acceptor.failure()) return error{std::move(acceptor).status()};
+    acceptors.push_back(std::move(*acceptor));
+  }
+  acceptors_ = std::move(acceptors);
+  buffer_pools_ = std::make_unique<buffer_pool[]>(contexts_.size());
+  options_ = options;
   return status_code::ok;
 }
 
@@ -482,8 +1492,48 @@ void http_server::handle(std::string path, handler h) noexcept {
   handlers_.try_emplace(std::move(path), std::move(h));
 }
 
+void http_server::handle_websocket(std::string path,
+                                   websocket_handler h) noexcept {
+  websocket_handlers_.try_emplace(std::move(path), std::move(h));
+}
+
+void http_server::handle_static(std::string path,
+                                std::string_view content_type,
+                                std::string_view payload) noexcept {
+  const auto render = [&](bool keep_alive) {
+    std::string header;
+    write_response_header(header, http_status::ok, content_type,
+                          payload.size(), keep_alive);
+    return header;
+  };
+  static_responses_.try_emplace(
+      std::move(path),
+      http_static_response{render(true), render(false), payload, {}});
+}
+
+void http_server::handle_static(std::string path,
+                                std::string_view content_type,
+                                file_range file) noexcept {
+  const auto render = [&](bool keep_alive) {
+    std::string header;
+    write_response_header(header, http_status::ok, content_type, file.size,
+                          keep_alive);
+    return header;
+  };
+  static_responses_.try_emplace(
+      std::move(path),
+      http_static_response{render(true), render(false), {}, file});
+}
+
+span<const buffer_pool> http_server::buffer_pools() const noexcept {
+  return span<const buffer_pool>(buffer_pools_.get(), contexts_.size());
+}
+
 void http_server::start() noexcept {
-  accept_handler::spawn(acceptor_, handlers_);
+  for (std::size_t i = 0; i < acceptors_.size(); i++) {
+    accept_handler::spawn(acceptors_[i], buffer_pools_[i], handlers_,
+                          static_responses_, websocket_handlers_, options_);
+  }
 }
 
 }  // namespace util
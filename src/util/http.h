@@ -1,10 +1,14 @@
 #pragma once
 
+#include "buffer_pool.h"
 #include "net.h"
 #include "result.h"
 #include "status.h"
+#include "websocket.h"
 
 #include <map>
+#include <optional>
+#include <vector>
 
 namespace util {
 
@@ -12,7 +16,9 @@ enum class http_status : int {
   ok = 200,
   bad_request = 400,
   not_found = 404,
+  request_timeout = 408,
   payload_too_large = 413,
+  upgrade_required = 426,
   request_header_fields_too_large = 431,
   internal_server_error = 500,
   not_implemented = 501,
@@ -28,52 +34,338 @@ enum class http_method {
 
 std::ostream& operator<<(std::ostream&, http_method) noexcept;
 
-struct uri {
+// The components of a URI, as views into the original string. Components are
+// not percent-decoded: use percent_decode() where the decoded form is needed.
+struct uri_view {
   // For an example URI `http://www.example.com:42/demo?q=42#f`:
-  std::string scheme;     // e.g. `http`
-  std::string authority;  // e.g. `www.example.com`
-  std::string path;       // e.g. `/demo`
-  std::string query;      // e.g. `q=42`
-  std::string fragment;   // e.g. `f`
+  std::string_view scheme;     // e.g. `http`
+  std::string_view authority;  // e.g. `www.example.com`
+  std::string_view path;       // e.g. `/demo`
+  std::string_view query;      // e.g. `q=42`
+  std::string_view fragment;   // e.g. `f`
 };
 
-result<uri> parse_uri(std::string_view input) noexcept;
+// Split a URI into its components, following the grammar in RFC 3986
+// appendix B. The result refers to the input, which must outlive it.
+result<uri_view> parse_uri(std::string_view input) noexcept;
+
+// Decode `%XX` escape sequences in a URI component.
+result<std::string> percent_decode(std::string_view input) noexcept;
+
+// Header fields which are recognised without comparing any strings. Each
+// request header is classified when it is parsed.
+enum class http_header : unsigned char {
+  unknown,
+  accept,
+  accept_encoding,
+  accept_language,
+  authorization,
+  cache_control,
+  connection,
+  content_length,
+  content_type,
+  cookie,
+  expect,
+  host,
+  if_modified_since,
+  if_none_match,
+  origin,
+  range,
+  referer,
+  sec_websocket_key,
+  sec_websocket_protocol,
+  sec_websocket_version,
+  transfer_encoding,
+  upgrade,
+  user_agent,
+};
+
+// Returns the well-known header with the given name, ignoring case, or
+// http_header::unknown.
+http_header classify_header(std::string_view name) noexcept;
+
+struct http_header_field {
+  http_header id;
+  std::string_view name;
+  std::string_view value;
+};
+
+// A read-only view of the header fields of a request. The names and values
+// refer directly to the request buffer, so a http_headers object is only valid
+// until the request has been responded to.
+class http_headers {
+ public:
+  constexpr http_headers() noexcept = default;
+  explicit constexpr http_headers(span<const http_header_field> fields) noexcept
+      : fields_(fields) {}
+
+  // Returns the value of the first header with the given id or name, or
+  // nothing if there is no such header. Names are compared case-insensitively.
+  std::optional<std::string_view> get(http_header id) const noexcept;
+  std::optional<std::string_view> get(std::string_view name) const noexcept;
+
+  // Access every header field, in the order in which they were received.
+  span<const http_header_field> fields() const noexcept { return fields_; }
+  const http_header_field* begin() const noexcept { return fields_.begin(); }
+  const http_header_field* end() const noexcept { return fields_.end(); }
+
+ private:
+  span<const http_header_field> fields_;
+};
 
 struct http_response {
+  // The payload is sent without being copied, so it must remain valid until
+  // the response is sent.
   std::string_view payload;
   std::string content_type;
+  // If this refers to a file, the body is sent directly from the file instead
+  // of from the payload. The file must remain open until the response is sent.
+  file_range file;
+};
+
+namespace detail {
+
+// The connection which received a request. A handler reaches it through the
+// http_body, http_responder and http_response_writer of the request.
+class http_exchange {
+ public:
+  virtual void read_body(
+      unique_function<void(result<span<const char>>)> done) noexcept = 0;
+  virtual void respond(result<http_response> response) noexcept = 0;
+  virtual void start_stream(std::string content_type) noexcept = 0;
+  virtual void write_chunk(span<const char> data,
+                           unique_function<void(status)> done) noexcept = 0;
+  virtual void finish_stream(bool complete) noexcept = 0;
+
+ protected:
+  ~http_exchange() noexcept = default;
+};
+
+}  // namespace detail
+
+// The body of a request, which can be read incrementally. A body sent with a
+// Content-Length has already been received in full by the time the handler
+// runs, so it is also available as http_request::payload. A body sent with
+// chunked transfer encoding can be arbitrarily long, so it is only available
+// from here, and is read from the connection as the handler asks for it.
+class http_body {
+ public:
+  constexpr http_body() noexcept = default;
+  explicit http_body(detail::http_exchange& exchange) noexcept
+      : exchange_(&exchange) {}
+
+  // Read the next part of the body. The continuation is invoked either with a
+  // status describing the failure or a span of bytes, which is only empty once
+  // the whole body has been read. The bytes remain valid until the next read
+  // or until the response has been sent. Only one read may be in progress at
+  // a time, and the body must not be read once the response has been sent.
+  void read(unique_function<void(result<span<const char>>)> done) noexcept {
+    exchange_->read_body(std::move(done));
+  }
+  auto read() noexcept {
+    return await_callback<result<span<const char>>>(
+        [exchange = exchange_](auto done) {
+          exchange->read_body(std::move(done));
+        });
+  }
+
+ private:
+  detail::http_exchange* exchange_ = nullptr;
+};
+
+// Sends the body of a response in pieces as they are produced, using chunked
+// transfer encoding (or, for a client which does not support it, by closing
+// the connection after the last piece). Each write completes once its data has
+// been handed to the socket, so a handler which waits for one write before
+// starting the next never has more than one piece of the body in memory.
+class http_response_writer {
+ public:
+  constexpr http_response_writer() noexcept = default;
+  explicit http_response_writer(detail::http_exchange& exchange) noexcept
+      : exchange_(&exchange) {}
+  // A writer which is destroyed without being finished aborts the response:
+  // the connection is closed without marking the end of the body, so the
+  // client can tell that the response is incomplete.
+  ~http_response_writer() noexcept;
+
+  // Not copyable.
+  http_response_writer(const http_response_writer&) = delete;
+  http_response_writer& operator=(const http_response_writer&) = delete;
+
+  // Movable.
+  http_response_writer(http_response_writer&& other) noexcept
+      : exchange_(std::exchange(other.exchange_, nullptr)) {}
+  http_response_writer& operator=(http_response_writer&& other) noexcept;
+
+  // Send the next piece of the body. The data must remain valid until the
+  // continuation is invoked, and the next write must not start until then.
+  void write(span<const char> data,
+             unique_function<void(status)> done) noexcept {
+    exchange_->write_chunk(data, std::move(done));
+  }
+  auto write(span<const char> data) noexcept {
+    return await_callback<status>([exchange = exchange_, data](auto done) {
+      exchange->write_chunk(data, std::move(done));
+    });
+  }
+
+  // Mark the end of the body. This may be called while the last write is
+  // still in progress, and the writer must not be used afterwards.
+  void finish() noexcept;
+
+ private:
+  detail::http_exchange* exchange_ = nullptr;
+};
+
+// Sends the response to a request. Every request gets exactly one response:
+// if the responder is destroyed without responding, the client gets a 500.
+class http_responder {
+ public:
+  constexpr http_responder() noexcept = default;
+  explicit http_responder(detail::http_exchange& exchange) noexcept
+      : exchange_(&exchange) {}
+  ~http_responder() noexcept;
+
+  // Not copyable.
+  http_responder(const http_responder&) = delete;
+  http_responder& operator=(const http_responder&) = delete;
+
+  // Movable.
+  http_responder(http_responder&& other) noexcept
+      : exchange_(std::exchange(other.exchange_, nullptr)) {}
+  http_responder& operator=(http_responder&& other) noexcept;
+
+  // Send a complete response.
+  void operator()(result<http_response> response) noexcept;
+
+  // Start a successful response whose body will be written in pieces. The
+  // header is sent along with the first piece.
+  http_response_writer stream(std::string content_type) noexcept;
+
+ private:
+  detail::http_exchange* exchange_ = nullptr;
 };
 
 struct http_request {
   http_method method;
-  uri target;
+  uri_view target;
+  http_headers headers;
+  // The body of a request with a Content-Length. This is empty if the body
+  // uses chunked transfer encoding, in which case it must be read from body.
+  std::string_view payload;
+  http_body body;
+  http_responder respond;
+};
+
+// A response which is rendered once, when it is registered with
+// http_server::handle_static(). The header block is kept in two variants
+// since it states whether the connection will stay open.
+struct http_static_response {
+  std::string keep_alive_header;
+  std::string close_header;
   std::string_view payload;
-  std::function<void(result<http_response>)> respond;
+  file_range file;
+};
+
+struct http_options {
+  // The maximum number of requests to serve on a single connection before
+  // closing it. If this is not positive, there is no limit.
+  int max_requests_per_connection = 1000;
+  // How long a connection may wait for the start of its next request before
+  // it is closed.
+  executor::duration idle_timeout = std::chrono::seconds(10);
+  // How long a client may take to send a complete request header, from its
+  // first byte, and then to send the payload. A request which misses either
+  // deadline gets a 408 response and the connection is closed.
+  executor::duration header_timeout = std::chrono::seconds(10);
+  // A chunked payload has no length limit, so the payload timeout applies to
+  // each read of its body instead.
+  executor::duration payload_timeout = std::chrono::seconds(30);
+  // How long a websocket may wait for each read from its peer. Peers which
+  // are idle for longer should send pings to keep the connection open.
+  executor::duration websocket_idle_timeout = std::chrono::seconds(60);
+  // Each request is read into a buffer of this size, which grows as needed up
+  // to max_request_size. Idle connections do not hold a buffer at all.
+  std::size_t initial_buffer_size = 4096;
+  // The largest request, including the header and payload, that the server
+  // will accept. This does not count a payload sent with chunked transfer
+  // encoding, which is passed to the handler a piece at a time.
+  std::size_t max_request_size = 65536;
+  // The maximum number of connections which each context serves at once.
+  // While a context is at the limit, it stops accepting connections (leaving
+  // them in the listen backlog) until one of its connections closes.
+  int max_connections = 10000;
+  // The length of the listen backlog for each context.
+  int backlog = 1024;
+  // The maximum number of waiting connections to accept in one go before
+  // letting other work run.
+  int accept_batch = 64;
+  // How long to stop accepting for if the process runs out of file
+  // descriptors or memory, unless a connection closes first.
+  executor::duration accept_retry_delay = std::chrono::milliseconds(100);
 };
 
 class http_server {
  public:
+  // Unlike the continuations elsewhere, handlers are std::function rather
+  // than unique_function: every context calls the same handlers at once,
+  // through a const reference, so they must be const-invocable. They are never
+  // copied after registration, so this costs nothing per request.
   using handler = std::function<void(http_request)>;
+  using websocket_handler = std::function<void(websocket)>;
 
   // Equivalent to constructing a http_server and calling init().
-  result<http_server> create(io_context&, const address&) noexcept;
+  result<http_server> create(io_context&, const address&,
+                             const http_options& options = {}) noexcept;
 
   // Construct an uninitialised http server.
   http_server(io_context& context) noexcept;
 
-  // Initialise the http server by binding it to the given address.
-  status init(const address&) noexcept;
+  // Construct an uninitialised http server which accepts connections on each
+  // of the given contexts. The contexts must outlive the server.
+  http_server(span<io_context> contexts) noexcept;
+
+  // Initialise the http server by binding it to the given address. If the
+  // server has multiple contexts, each one gets its own listening socket bound
+  // with SO_REUSEPORT.
+  status init(const address&, const http_options& options = {}) noexcept;
 
   // Add a handler for the given path.
   void handle(std::string path, handler) noexcept;
 
-  // Handle work for the server.
+  // Accept websocket connections on the given path. The server completes the
+  // opening handshake and then passes the websocket to the handler, which owns
+  // the connection from then on. A request for the path which is not a valid
+  // websocket handshake gets an error response.
+  void handle_websocket(std::string path, websocket_handler) noexcept;
+
+  // Serve a fixed payload for the given path. The response is rendered up
+  // front, and the payload is sent directly from the given memory on every
+  // request, so it must remain valid for the lifetime of the server.
+  void handle_static(std::string path, std::string_view content_type,
+                     std::string_view payload) noexcept;
+  // Like above, but the payload is sent directly from the given range of a
+  // file, which must remain open for the lifetime of the server.
+  void handle_static(std::string path, std::string_view content_type,
+                     file_range file) noexcept;
+
+  // Handle work for the server. Every context shares the same handlers, so
+  // handle() must not be called after this point.
   void start() noexcept;
 
+  // The pools which connections take their buffers from, one for each
+  // context. Only valid after init(). The statistics of each pool can be read
+  // from any thread.
+  span<const buffer_pool> buffer_pools() const noexcept;
+
  private:
-  io_context* context_;
-  tcp::acceptor acceptor_;
-  std::map<std::string, handler> handlers_;
+  span<io_context> contexts_;
+  std::vector<tcp::acceptor> acceptors_;
+  std::unique_ptr<buffer_pool[]> buffer_pools_;
+  std::map<std::string, handler, std::less<>> handlers_;
+  std::map<std::string, websocket_handler, std::less<>> websocket_handlers_;
+  std::map<std::string, http_static_response, std::less<>> static_responses_;
+  http_options options_;
 };
 
 }  // namespace util
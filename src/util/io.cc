@@ -29,4 +29,18 @@ std::string_view contents(const char* filename) noexcept {
   return std::string_view(data, info.st_size);
 }
 
+file_range file_contents(const char* filename) noexcept {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Cannot open file: " << filename << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    std::cerr << "Cannot stat file: " << filename << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+  return file_range{file_handle{fd}, 0, (std::uint64_t)info.st_size};
+}
+
 }  // namespace util
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "net.h"
+
 #include <string_view>
 
 namespace util {
@@ -10,4 +12,10 @@ namespace util {
 // the program will exit.
 std::string_view contents(const char* filename) noexcept;
 
+// Returns a range covering the entire contents of the given file, which is
+// assumed to be read-only for the entire server lifetime. The file is kept
+// open for the whole lifetime of the program. If the file cannot be opened,
+// the program will exit.
+file_range file_contents(const char* filename) noexcept;
+
 }  // namespace util
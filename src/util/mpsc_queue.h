@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace util {
+
+// An unbounded lock-free queue with any number of producers and a single
+// consumer. Values are held in a linked list of nodes: a producer claims the
+// tail with a single atomic exchange and then links its node to the previous
+// one, so pushing never waits for other threads. A value whose producer has
+// claimed the tail but not yet linked its node (and every value after it) is
+// briefly invisible to the consumer, so the queue may appear empty while a
+// push is in progress.
+//
+// T must be default constructible, since the list always starts with a dummy
+// node.
+template <typename T>
+class mpsc_queue {
+ public:
+  mpsc_queue() noexcept : head_(&stub_), tail_(&stub_) {}
+
+  ~mpsc_queue() noexcept {
+    T value;
+    while (pop(value)) {}
+    if (head_ != &stub_) delete head_;
+  }
+
+  // Not copyable or movable: producers hold a pointer to the queue.
+  mpsc_queue(const mpsc_queue&) = delete;
+  mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+  // Add a value to the back of the queue. This may be called from any thread.
+  void push(T value) noexcept {
+    node* n = new node{std::move(value)};
+    node* previous = tail_.exchange(n, std::memory_order_acq_rel);
+    previous->next.store(n, std::memory_order_release);
+  }
+
+  // Remove the value at the front of the queue, if there is one. This must
+  // only be called by the consumer.
+  bool pop(T& out) noexcept {
+    node* next = head_->next.load(std::memory_order_acquire);
+    if (!next) return false;
+    // The popped node becomes the new dummy node, so its value is moved out
+    // and the old dummy node is freed.
+    out = std::move(next->value);
+    if (head_ != &stub_) delete head_;
+    head_ = next;
+    return true;
+  }
+
+  // Returns true if the consumer would see an empty queue. This must only be
+  // called by the consumer.
+  bool empty() const noexcept {
+    return head_->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+ private:
+  struct node {
+    T value;
+    std::atomic<node*> next = nullptr;
+  };
+
+  // Only accessed by the consumer.
+  node* head_;
+  node stub_;
+  // Shared by the producers. This is kept on a separate cache line from the
+  // consumer's state so that pushing does not slow down popping.
+  alignas(64) std::atomic<node*> tail_;
+};
+
+}  // namespace util
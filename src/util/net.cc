@@ -1,11 +1,24 @@
 #include "net.h"
 
+#include "mpsc_queue.h"
+
 #include <arpa/inet.h>
+#include <climits>
 #include <fcntl.h>
 #include <iostream>
+#include <linux/io_uring.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 
@@ -14,11 +27,12 @@ namespace {
 
 using std::chrono_literals::operator""ms;
 
-// Order time points in *descending* order so that they are put in *ascending*
-// order in a heap.
-constexpr auto by_time = [](auto& l, auto& r) {
-  return l.time > r.time;
-};
+// The size of the io_uring submission queue for each io_context.
+constexpr unsigned uring_entries = 1024;
+
+// The io_uring user data for reads from the wakeup eventfd. Operation ids
+// never have zero in their lower half, so this cannot clash with them.
+constexpr std::uint64_t wakeup_user_data = std::uint64_t{1} << 32;
 
 void must(const status& status) {
 #ifndef NDEBUG
@@ -31,23 +45,305 @@ void must(const status& status) {
 #endif
 }
 
-// Shared implementation for await_in and await_out: register interest for an IO
-// operation in the epoll instance.
-template <io_state::task io_state::*op>
-status await_op(file_handle epoll, io_state& state,
-                io_state::task resume) noexcept {
-  state.*op = std::move(resume);
-  epoll_event event;
-  event.events = EPOLLONESHOT | (state.do_in ? EPOLLIN : 0) |
-                 (state.do_out ? EPOLLOUT : 0);
-  event.data.ptr = &state;
-  if (epoll_ctl((int)epoll, EPOLL_CTL_MOD, (int)state.handle, &event) == -1) {
-    return std::errc{errno};
+bool would_block(int code) noexcept {
+  return code == EAGAIN || code == EWOULDBLOCK;
+}
+
+// Each operation below performs a single system call in try_now(), which
+// returns false without invoking the continuation if the call would block.
+// An operation is either attempted directly, or run once its handle is ready
+// by wrapping it in a retry_op.
+
+// Record that a handle is no longer ready for an operation, after the
+// operation found that it would block.
+template <typename Op>
+void clear_ready(io_state& state) noexcept {
+  if constexpr (Op::is_input) {
+    state.readable = false;
   } else {
-    return status_code::ok;
+    state.writable = false;
   }
 }
 
+// If the operation has been cancelled, fail it with the reason for the
+// cancellation and return true.
+template <typename Op>
+bool fail_if_cancelled(Op& op) noexcept {
+  std::errc& reason =
+      Op::is_input ? op.state->in_cancelled : op.state->out_cancelled;
+  if (reason == std::errc{}) return false;
+  op.done(error{std::exchange(reason, std::errc{})});
+  return true;
+}
+
+// Attempt an operation immediately if the context allows it. Returns true if
+// the operation completed, in which case its continuation has been invoked.
+template <typename Op>
+bool try_direct(io_context& context, Op& op) noexcept {
+  if (fail_if_cancelled(op)) return true;
+  if (!context.can_complete_inline()) return false;
+  io_context::inline_scope scope(context);
+  if (op.try_now()) return true;
+  clear_ready<Op>(*op.state);
+  return false;
+}
+
+// Run an operation once its handle is ready. A handle which was reported as
+// ready may have been drained since (with edge-triggered epoll, readiness is
+// only reported once), so if the operation would still block, this waits
+// again instead of failing.
+template <typename Op>
+struct retry_op {
+  io_context* context;
+  Op op;
+
+  void operator()() noexcept {
+    if (fail_if_cancelled(op) || op.try_now()) return;
+    clear_ready<Op>(*op.state);
+    await(std::move(*this));
+  }
+
+  static void await(retry_op self) noexcept {
+    io_state& state = *self.op.state;
+    io_context& context = *self.context;
+    status s = Op::is_input ? context.await_in(state, std::move(self))
+                            : context.await_out(state, std::move(self));
+    if (s.failure()) self.op.done(error{std::move(s)});
+  }
+};
+
+// Attempt an operation immediately if possible, or once its handle is ready
+// otherwise.
+template <typename Op>
+void start(io_context& context, Op op) noexcept {
+  if (try_direct(context, op)) return;
+  retry_op<Op>::await(retry_op<Op>{&context, std::move(op)});
+}
+
+// Operation for stream::read_some. With io_uring, the kernel performs the read
+// and the result is passed to complete() directly.
+struct read_some_op {
+  static constexpr bool is_input = true;
+
+  io_state* state;
+  span<char> buffer;
+  unique_function<void(result<span<char>>)> done;
+
+  bool try_now() noexcept {
+    int result = ::read((int)state->handle, buffer.data(), buffer.size());
+    if (result == -1 && would_block(errno)) return false;
+    complete(result == -1 ? -errno : result);
+    return true;
+  }
+
+  void complete(int result) noexcept {
+    if (result >= 0) {
+      done(buffer.subspan(0, result));
+    } else {
+      done(error{std::errc{-result}});
+    }
+  }
+};
+
+// Operation for stream::write_some, in the same style as read_some_op.
+struct write_some_op {
+  static constexpr bool is_input = false;
+
+  io_state* state;
+  span<const char> buffer;
+  unique_function<void(result<span<const char>>)> done;
+
+  bool try_now() noexcept {
+    int result =
+        ::send((int)state->handle, buffer.data(), buffer.size(), MSG_NOSIGNAL);
+    if (result == -1 && would_block(errno)) return false;
+    complete(result == -1 ? -errno : result);
+    return true;
+  }
+
+  void complete(int result) noexcept {
+    if (result >= 0) {
+      done(buffer.subspan(result));
+    } else {
+      done(error{std::errc{-result}});
+    }
+  }
+};
+
+// Operation for a gathered stream::write. The offset is the number of bytes of
+// the first buffer that have already been written. The continuation receives
+// the total number of bytes written.
+struct gather_write_op {
+  static constexpr bool is_input = false;
+  // The maximum number of buffers to pass to a single system call.
+  static constexpr std::size_t max_buffers = 16;
+
+  io_state* state;
+  span<const span<const char>> buffers;
+  std::size_t offset;
+  unique_function<void(result<std::size_t>)> done;
+
+  bool try_now() noexcept {
+    std::array<iovec, max_buffers> iov;
+    const std::size_t n = std::min(buffers.size(), max_buffers);
+    for (std::size_t i = 0; i < n; i++) {
+      iov[i].iov_base = const_cast<char*>(buffers[i].data());
+      iov[i].iov_len = buffers[i].size();
+    }
+    if (n > 0) {
+      iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + offset;
+      iov[0].iov_len -= offset;
+    }
+    msghdr message = {};
+    message.msg_iov = iov.data();
+    message.msg_iovlen = n;
+    const int result = ::sendmsg((int)state->handle, &message, MSG_NOSIGNAL);
+    if (result == -1 && would_block(errno)) return false;
+    if (result != -1) {
+      done(std::size_t(result));
+    } else {
+      done(error{std::errc{errno}});
+    }
+    return true;
+  }
+};
+
+// Operation for a scattered stream::read_some. The continuation receives the
+// total number of bytes read.
+struct scatter_read_op {
+  static constexpr bool is_input = true;
+  // The maximum number of buffers to pass to a single system call.
+  static constexpr std::size_t max_buffers = 16;
+
+  io_state* state;
+  span<const span<char>> buffers;
+  unique_function<void(result<std::size_t>)> done;
+
+  bool try_now() noexcept {
+    std::array<iovec, max_buffers> iov;
+    const std::size_t n = std::min(buffers.size(), max_buffers);
+    for (std::size_t i = 0; i < n; i++) {
+      iov[i].iov_base = buffers[i].data();
+      iov[i].iov_len = buffers[i].size();
+    }
+    const ssize_t result = ::readv((int)state->handle, iov.data(), n);
+    if (result == -1 && would_block(errno)) return false;
+    if (result != -1) {
+      done(std::size_t(result));
+    } else {
+      done(error{std::errc{errno}});
+    }
+    return true;
+  }
+};
+
+// Operation for stream::await_readable. This peeks at the input to find out
+// whether there is anything to read, without consuming it.
+struct await_readable_op {
+  static constexpr bool is_input = true;
+
+  io_state* state;
+  unique_function<void(status)> done;
+
+  bool try_now() noexcept {
+    char c;
+    const int result =
+        ::recv((int)state->handle, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (result == -1 && would_block(errno)) return false;
+    // Errors are left for the next read to discover.
+    done(status_code::ok);
+    return true;
+  }
+};
+
+// Operation for stream::send_file. This sends as much of the prefix as
+// possible and then, if the whole prefix was sent, as much of the file as
+// possible. The continuation receives the total number of bytes sent.
+struct send_file_op {
+  static constexpr bool is_input = false;
+  // The largest number of bytes to send with a single sendfile() call.
+  static constexpr std::uint64_t max_chunk = 1 << 30;
+
+  io_state* state;
+  span<const char> prefix;
+  file_range file;
+  unique_function<void(result<std::size_t>)> done;
+
+  bool try_now() noexcept {
+    std::size_t sent = 0;
+    if (!prefix.empty()) {
+      // MSG_MORE holds back the prefix so that it shares packets with the
+      // start of the file rather than being sent on its own. Without a file to
+      // follow, nothing would flush it until the kernel's timer runs out.
+      const int flags = MSG_NOSIGNAL | (file.size > 0 ? MSG_MORE : 0);
+      const int result =
+          ::send((int)state->handle, prefix.data(), prefix.size(), flags);
+      if (result == -1) return finish(0, errno);
+      sent = result;
+      if (sent < prefix.size()) {
+        done(sent);
+        return true;
+      }
+    }
+    if (file.size > 0) {
+      off_t offset = file.offset;
+      const ssize_t result =
+          ::sendfile((int)state->handle, (int)file.handle, &offset,
+                     std::min(file.size, max_chunk));
+      if (result == -1) return finish(sent, errno);
+      if (result == 0) {
+        // The file is shorter than the range that was requested.
+        done(error{std::errc::io_error});
+        return true;
+      }
+      sent += result;
+    }
+    done(sent);
+    return true;
+  }
+
+  // Report a failed system call, after some number of bytes were sent.
+  bool finish(std::size_t sent, int code) noexcept {
+    if (sent > 0) {
+      done(sent);
+      return true;
+    }
+    if (would_block(code)) return false;
+    done(error{std::errc{code}});
+    return true;
+  }
+};
+
+// Operation for acceptor::accept, in the same style as read_some_op.
+struct accept_op {
+  static constexpr bool is_input = true;
+
+  io_context* context;
+  io_state* state;
+  unique_function<void(result<tcp::stream>)> done;
+
+  bool try_now() noexcept {
+    int handle = ::accept4((int)state->handle, nullptr, nullptr, SOCK_NONBLOCK);
+    if (handle == -1 && would_block(errno)) return false;
+    complete(handle == -1 ? -errno : handle);
+    return true;
+  }
+
+  void complete(int handle) noexcept {
+    if (handle < 0) {
+      done(error{std::errc{-handle}});
+      return;
+    }
+    result<socket> s =
+        socket::create(*context, unique_handle{file_handle{handle}});
+    if (s.success()) {
+      done(std::move(*s));
+    } else {
+      done(error{std::move(s).status()});
+    }
+  }
+};
+
 // Base status manager for get_address_info codes.
 struct gai_code_manager : status_manager {
   constexpr std::uint64_t domain_id() const noexcept final {
@@ -175,6 +471,26 @@ status allow_address_reuse(socket& socket) {
   return status_code::ok;
 }
 
+// Allow several sockets to bind to the same address and port. Incoming
+// connections are distributed between them by the kernel.
+status allow_port_reuse(socket& socket) {
+  int enable = 1;
+  int r = setsockopt((int)socket.handle(), SOL_SOCKET, SO_REUSEPORT, &enable,
+                     sizeof(int));
+  if (r == -1) return std::errc{errno};
+  return status_code::ok;
+}
+
+// Restrict the calling thread to run only on the given CPU core.
+status pin_to_core(int core) noexcept {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  const int r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (r != 0) return status(std::errc{r}, "in pin_to_core()");
+  return status_code::ok;
+}
+
 struct host_port {
   char host[248];
   char port[8];
@@ -220,85 +536,412 @@ status unique_handle::close() noexcept {
   return status_code::ok;
 }
 
-result<io_context> io_context::create() noexcept {
+result<io_context> io_context::create(const io_options& options) noexcept {
   io_context context;
-  if (status s = context.init(); s.failure()) return error{std::move(s)};
+  if (status s = context.init(options); s.failure()) {
+    return error{std::move(s)};
+  }
   return context;
 }
 
-io_context::io_context() noexcept {}
+struct io_context::remote_queue {
+  mpsc_queue<task> tasks;
+  // Set while the context is blocked (or about to block) waiting for IO. A
+  // poster which clears it is responsible for signalling the eventfd.
+  std::atomic<bool> sleeping = false;
+  unique_handle wakeup;
+  // The destination for reads from the eventfd.
+  std::uint64_t wakeup_count = 0;
+};
 
-status io_context::init() noexcept {
+io_context::io_context() noexcept {}
+io_context::~io_context() noexcept = default;
+io_context::io_context(io_context&&) noexcept = default;
+io_context& io_context::operator=(io_context&&) noexcept = default;
+
+status io_context::init(const io_options& options) noexcept {
+  direct_io_ = options.direct_io;
+  max_tasks_per_iteration_ =
+      std::max<std::size_t>(1, options.max_tasks_per_iteration);
+  edge_triggered_ = options.edge_triggered;
+  remote_ = std::make_unique<remote_queue>();
+  // The eventfd is left blocking, since it is only read once it is known to
+  // be signalled, and it can never fill up because every wakeup resets it.
+  remote_->wakeup = unique_handle{file_handle{eventfd(0, EFD_CLOEXEC)}};
+  if (!remote_->wakeup) {
+    return error{
+        status(std::errc{errno}, "from eventfd in io_context::init()")};
+  }
+  if (options.backend == io_backend::io_uring) {
+    if (uring_.init(uring_entries).success()) {
+      backend_ = io_backend::io_uring;
+      submit_wakeup();
+      return status_code::ok;
+    }
+    // io_uring is not available, so fall back to epoll.
+  }
+  backend_ = io_backend::epoll;
   epoll_ = unique_handle{file_handle{epoll_create(/*unused size*/42)}};
   if (!epoll_) {
     return error{
         status(std::errc{errno}, "from epoll_create in io_context::create()")};
   }
+  // The eventfd is the only registration without an io_state, which is how
+  // poll_epoll() tells it apart.
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_ADD,
+                (int)remote_->wakeup.get(), &event) == -1) {
+    return error{
+        status(std::errc{errno}, "from epoll_ctl in io_context::init()")};
+  }
   return status_code::ok;
 }
 
+io_backend io_context::backend() const noexcept { return backend_; }
+
 io_context::io_context(unique_handle epoll) noexcept
     : epoll_(std::move(epoll)) {}
 
-void io_context::schedule_at(time_point time, task f) noexcept {
-  work_.push_back({time, std::move(f)});
-  std::push_heap(work_.begin(), work_.end(), by_time);
+executor::timer io_context::schedule_at(time_point time, task f) noexcept {
+  return make_timer(timers_.add(time, std::move(f)));
 }
 
+executor::timer io_context::schedule(task f) noexcept {
+  ready_.push_back(std::move(f));
+  return timer();
+}
+
+void io_context::post(task f) noexcept {
+  remote_queue& remote = *remote_;
+  remote.tasks.push(std::move(f));
+  // Pairs with the fence in prepare_to_sleep(): either the context sees this
+  // task before it blocks, or this sees that the context is blocking.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!remote.sleeping.load(std::memory_order_relaxed) ||
+      !remote.sleeping.exchange(false, std::memory_order_relaxed)) {
+    return;
+  }
+  const std::uint64_t one = 1;
+  if (write((int)remote.wakeup.get(), &one, sizeof(one)) == -1) {
+    must(status(std::errc{errno}, "from write in io_context::post()"));
+  }
+}
+
+void io_context::submit_wakeup() noexcept {
+  io_uring_sqe* sqe = get_sqe();
+  // The queue is only full if the kernel refused to take any entries, in
+  // which case the loop is about to fail anyway.
+  if (!sqe) return;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = (int)remote_->wakeup.get();
+  sqe->addr = reinterpret_cast<std::uint64_t>(&remote_->wakeup_count);
+  sqe->len = sizeof(remote_->wakeup_count);
+  sqe->user_data = wakeup_user_data;
+}
+
+void io_context::take_posted() noexcept {
+  task f;
+  while (remote_->tasks.pop(f)) ready_.push_back(std::move(f));
+}
+
+bool io_context::prepare_to_sleep() noexcept {
+  remote_queue& remote = *remote_;
+  remote.sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (remote.tasks.empty()) return true;
+  remote.sleeping.store(false, std::memory_order_relaxed);
+  return false;
+}
+
+bool io_context::cancel(timer_id id) noexcept { return timers_.cancel(id); }
+
 status io_context::run() {
   // TODO: Find a neat way of tracking how many pending IO operations the
   // context has and use this to allow run() to return when all work finishes.
+  time_point now = clock::now();
   while (true) {
-    // Run all work that should have triggered by now.
-    const time_point now = clock::now();
-    while (!work_.empty() && work_.front().time <= now) {
-      std::pop_heap(work_.begin(), work_.end(), by_time);
-      work_item work = std::move(work_.back());
-      work_.pop_back();
-      work.resume();
-    }
-    // Wait for IO until the next work item is ready.
-    const int timeout_ms =
-        work_.empty() ? -1 : (work_.front().time - now) / 1ms;
-    std::array<epoll_event, 256> events;
-    const int num_events =
-        epoll_wait((int)epoll_.get(), events.data(), events.size(), timeout_ms);
-    if (num_events == -1 && errno != EINTR) {
-      return error{
-          status(std::errc{errno}, "from epoll_wait in io_context::run()")};
-    }
-    for (int i = 0; i < num_events; i++) {
-      auto& state = *static_cast<io_state*>(events[i].data.ptr);
-      unsigned mask = events[i].events;
-      // If an error occurred or the socket was closed, treat it as both read
-      // and write being ready. The handlers will attempt their operations and
-      // discover the errors themselves.
-      if (mask & (EPOLLERR | EPOLLHUP)) mask |= EPOLLIN | EPOLLOUT;
-      // Run handlers that are ready. These are scheduled rather than being
-      // invoked directly to avoid having to deal with reentrancy.
-      if ((mask & EPOLLIN) && state.do_in) {
-        schedule(std::exchange(state.do_in, nullptr));
-      }
-      if ((mask & EPOLLOUT) && state.do_out) {
-        schedule(std::exchange(state.do_out, nullptr));
+    stats_.iterations++;
+    timers_.advance(now);
+    std::size_t budget = max_tasks_per_iteration_;
+    budget -= run_timers(budget);
+    const time_point timers_done = clock::now();
+    take_posted();
+    budget -= run_ready(budget);
+    if (std::exchange(stopping_, false)) return status_code::ok;
+    const time_point ready_done = clock::now();
+    stats_.tasks_run += max_tasks_per_iteration_ - budget;
+    stats_.timer_time += timers_done - now;
+    stats_.ready_time += ready_done - timers_done;
+    if (budget == 0 && (!ready_.empty() || timers_.num_expired() > 0)) {
+      stats_.budget_exhausted++;
+    }
+    int timeout_ms = poll_timeout(ready_done);
+    if (timeout_ms != 0 && !prepare_to_sleep()) timeout_ms = 0;
+    status s = backend_ == io_backend::io_uring ? poll_uring(timeout_ms)
+                                                : poll_epoll(timeout_ms);
+    remote_->sleeping.store(false, std::memory_order_relaxed);
+    now = clock::now();
+    stats_.poll_time += now - ready_done;
+    if (s.failure()) return s;
+  }
+}
+
+void io_context::stop() noexcept {
+  post([this] { stopping_ = true; });
+}
+
+std::size_t io_context::run_timers(std::size_t budget) noexcept {
+  // Expired timers are run straight from the wheel so that they can still be
+  // cancelled up until the moment that they run.
+  std::size_t n = 0;
+  while (n < budget && timers_.num_expired() > 0) {
+    timers_.pop()();
+    n++;
+  }
+  return n;
+}
+
+std::size_t io_context::run_ready(std::size_t budget) noexcept {
+  // Only tasks which are already in the queue are run. Tasks which they
+  // schedule will not run until after the next check for IO.
+  const std::size_t depth = ready_.size();
+  stats_.ready_depth = depth;
+  stats_.max_ready_depth = std::max(stats_.max_ready_depth, depth);
+  const std::size_t n = std::min(depth, budget);
+  for (std::size_t i = 0; i < n; i++) {
+    task f = std::move(ready_.front());
+    ready_.pop_front();
+    f();
+  }
+  return n;
+}
+
+int io_context::poll_timeout(time_point now) const noexcept {
+  if (!ready_.empty() || timers_.num_expired() > 0) return 0;
+  const std::optional<time_point> next = timers_.next_expiry();
+  if (!next) return -1;
+  // Round up so that the work is definitely due when the wait finishes.
+  const auto delay = std::chrono::ceil<std::chrono::milliseconds>(*next - now);
+  return std::clamp<std::int64_t>(delay.count(), 0, INT_MAX);
+}
+
+status io_context::poll_epoll(int timeout_ms) noexcept {
+  std::array<epoll_event, 256> events;
+  const int num_events =
+      epoll_wait((int)epoll_.get(), events.data(), events.size(), timeout_ms);
+  if (num_events == -1 && errno != EINTR) {
+    return error{
+        status(std::errc{errno}, "from epoll_wait in io_context::run()")};
+  }
+  for (int i = 0; i < num_events; i++) {
+    if (!events[i].data.ptr) {
+      // Reset the wakeup eventfd. Posted tasks are picked up by run().
+      if (read((int)remote_->wakeup.get(), &remote_->wakeup_count,
+               sizeof(remote_->wakeup_count)) == -1) {
+        return error{
+            status(std::errc{errno}, "from read in io_context::run()")};
       }
-      mask = (state.do_in ? EPOLLIN : 0) | (state.do_out ? EPOLLOUT : 0);
-      if (mask) {
-        // There are other pending I/O handlers. Update the event entry.
-        events[i].events = EPOLLONESHOT | mask;
-        if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_MOD, (int)state.handle,
-                      &events[i]) == -1) {
-          return error{
-              status(std::errc{errno}, "from epoll_ctl in io_context::run()")};
-        }
+      continue;
+    }
+    auto& state = *static_cast<io_state*>(events[i].data.ptr);
+    unsigned mask = events[i].events;
+    // If an error occurred or the socket was closed, treat it as both read
+    // and write being ready. The handlers will attempt their operations and
+    // discover the errors themselves.
+    if (mask & (EPOLLERR | EPOLLHUP)) mask |= EPOLLIN | EPOLLOUT;
+    if (mask & EPOLLRDHUP) mask |= EPOLLIN;
+    if (edge_triggered_) {
+      // The registration stays armed, so only the readiness needs updating.
+      if (mask & EPOLLIN) state.readable = true;
+      if (mask & EPOLLOUT) state.writable = true;
+    }
+    // Run handlers that are ready. These are scheduled rather than being
+    // invoked directly to avoid having to deal with reentrancy.
+    if ((mask & EPOLLIN) && state.do_in) {
+      schedule(std::exchange(state.do_in, nullptr));
+    }
+    if ((mask & EPOLLOUT) && state.do_out) {
+      schedule(std::exchange(state.do_out, nullptr));
+    }
+    mask = (state.do_in ? EPOLLIN : 0) | (state.do_out ? EPOLLOUT : 0);
+    if (mask && !edge_triggered_) {
+      // There are other pending I/O handlers. Update the event entry.
+      events[i].events = EPOLLONESHOT | mask;
+      if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_MOD, (int)state.handle,
+                    &events[i]) == -1) {
+        return error{
+            status(std::errc{errno}, "from epoll_ctl in io_context::run()")};
       }
     }
   }
+  return status_code::ok;
+}
+
+status io_context::poll_uring(int timeout_ms) noexcept {
+  // Submit every operation queued since the last poll along with the wait, so
+  // that a whole batch costs a single system call.
+  if (status s = uring_.enter(timeout_ms != 0, timeout_ms); s.failure()) {
+    return error{std::move(s)};
+  }
+  uring_completion completion;
+  while (uring_.pop(completion)) finish_uring_op(completion);
+  return status_code::ok;
+}
+
+io_uring_sqe* io_context::get_sqe() noexcept {
+  if (io_uring_sqe* sqe = uring_.get_sqe()) return sqe;
+  // The submission queue is full. Submit what is there to make space.
+  if (uring_.enter(false, 0).failure()) return nullptr;
+  return uring_.get_sqe();
+}
+
+io_uring_sqe* io_context::start_uring_op(io_state& state, uring_op_kind kind,
+                                         io_state::completion& done) noexcept {
+  io_uring_sqe* sqe = get_sqe();
+  if (!sqe) return nullptr;
+  std::uint32_t index = free_uring_op_;
+  if (index == uring_ops_.size()) {
+    uring_ops_.emplace_back();
+    free_uring_op_ = uring_ops_.size();
+  } else {
+    free_uring_op_ = uring_ops_[index].next_free;
+  }
+  uring_op& op = uring_ops_[index];
+  op.state = &state;
+  op.kind = kind;
+  op.done = std::move(done);
+  // The user data identifies both the slot and the generation of the slot, so
+  // that a stale identifier never refers to a newer operation. Zero is
+  // reserved for operations whose completions should be ignored.
+  const std::uint64_t id = (std::uint64_t)op.generation << 32 | (index + 1);
+  const bool in = kind == uring_op_kind::poll_in ||
+                  kind == uring_op_kind::recv || kind == uring_op_kind::accept;
+  std::uint64_t& slot = in ? state.uring_in : state.uring_out;
+  assert(slot == 0);
+  slot = id;
+  sqe->fd = (int)state.handle;
+  sqe->user_data = id;
+  return sqe;
+}
+
+void io_context::finish_uring_op(const uring_completion& completion) noexcept {
+  if (completion.user_data == 0) return;
+  if (completion.user_data == wakeup_user_data) {
+    // The read has reset the eventfd, so wait for the next wakeup.
+    submit_wakeup();
+    return;
+  }
+  const std::uint32_t index = (completion.user_data & 0xFFFF'FFFF) - 1;
+  uring_op& op = uring_ops_[index];
+  io_state* const state = op.state;
+  const uring_op_kind kind = op.kind;
+  io_state::completion done = std::move(op.done);
+  op.state = nullptr;
+  op.generation++;
+  op.next_free = free_uring_op_;
+  free_uring_op_ = index;
+  // If the state was unregistered, the result is no longer wanted.
+  if (!state) return;
+  switch (kind) {
+    case uring_op_kind::poll_in:
+      state->uring_in = 0;
+      // Scheduled rather than invoked directly, in the same way as epoll.
+      if (state->do_in) schedule(std::exchange(state->do_in, nullptr));
+      break;
+    case uring_op_kind::poll_out:
+      state->uring_out = 0;
+      if (state->do_out) schedule(std::exchange(state->do_out, nullptr));
+      break;
+    case uring_op_kind::recv:
+    case uring_op_kind::accept:
+      state->uring_in = 0;
+      done(cancelled_result(state->in_cancelled, completion.result));
+      break;
+    case uring_op_kind::send:
+      state->uring_out = 0;
+      done(cancelled_result(state->out_cancelled, completion.result));
+      break;
+  }
+}
+
+int io_context::cancelled_result(std::errc& reason, int result) noexcept {
+  // An operation which completed before the cancellation took effect keeps
+  // its result, and the cancellation applies to the next operation instead.
+  if (reason == std::errc{} || result != -ECANCELED) return result;
+  return -(int)std::exchange(reason, std::errc{});
+}
+
+void io_context::cancel_in(io_state& state, std::errc reason) noexcept {
+  state.in_cancelled = reason;
+  cancel_op(state.do_in, state.uring_in);
+}
+
+void io_context::cancel_out(io_state& state, std::errc reason) noexcept {
+  state.out_cancelled = reason;
+  cancel_op(state.do_out, state.uring_out);
+}
+
+void io_context::cancel_op(task& resume, std::uint64_t uring_op) noexcept {
+  if (uring_op != 0) {
+    // The operation's completion (or, for a poll, the task it wakes up) sees
+    // the cancellation once the kernel reports that it has finished.
+    if (io_uring_sqe* sqe = get_sqe()) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = uring_op;
+    }
+    return;
+  }
+  // A task which is waiting for readiness checks for the cancellation when
+  // it runs, so it only needs to be woken up.
+  if (resume) schedule(std::exchange(resume, nullptr));
+}
+
+void io_context::submit_recv(io_state& state, span<char> buffer,
+                             io_state::completion done) noexcept {
+  io_uring_sqe* sqe = start_uring_op(state, uring_op_kind::recv, done);
+  if (!sqe) {
+    schedule([done = std::move(done)]() mutable { done(-EBUSY); });
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->addr = reinterpret_cast<std::uint64_t>(buffer.data());
+  sqe->len = buffer.size();
+}
+
+void io_context::submit_send(io_state& state, span<const char> buffer,
+                             io_state::completion done) noexcept {
+  io_uring_sqe* sqe = start_uring_op(state, uring_op_kind::send, done);
+  if (!sqe) {
+    schedule([done = std::move(done)]() mutable { done(-EBUSY); });
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->addr = reinterpret_cast<std::uint64_t>(buffer.data());
+  sqe->len = buffer.size();
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void io_context::submit_accept(io_state& state,
+                               io_state::completion done) noexcept {
+  io_uring_sqe* sqe = start_uring_op(state, uring_op_kind::accept, done);
+  if (!sqe) {
+    schedule([done = std::move(done)]() mutable { done(-EBUSY); });
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->accept_flags = SOCK_NONBLOCK;
 }
 
 status io_context::register_handle(io_state& state) noexcept {
+  // With io_uring, every operation names its file handle directly.
+  if (backend_ == io_backend::io_uring) return status_code::ok;
   epoll_event event;
-  event.events = 0;
+  // In edge-triggered mode, this is the only epoll_ctl() call for the handle
+  // until it is unregistered.
+  event.events =
+      edge_triggered_ ? EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET : 0;
   event.data.ptr = &state;
   if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_ADD, (int)state.handle, &event) ==
       -1) {
@@ -307,19 +950,122 @@ status io_context::register_handle(io_state& state) noexcept {
   return status_code::ok;
 }
 
-status io_context::unregister_handle(file_handle handle) noexcept {
-  if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_DEL, (int)handle, nullptr) == -1) {
+status io_context::unregister_handle(io_state& state) noexcept {
+  if (backend_ == io_backend::io_uring) {
+    // Detach any outstanding operations from the state and ask the kernel to
+    // cancel them. Their completions are kept alive until the kernel reports
+    // that the operation has finished, since they may own the buffers that
+    // the kernel is using.
+    for (std::uint64_t* slot : {&state.uring_in, &state.uring_out}) {
+      if (*slot == 0) continue;
+      uring_ops_[(*slot & 0xFFFF'FFFF) - 1].state = nullptr;
+      if (io_uring_sqe* sqe = get_sqe()) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = *slot;
+      }
+      *slot = 0;
+    }
+    return status_code::ok;
+  }
+  if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_DEL, (int)state.handle, nullptr) ==
+      -1) {
     return status(std::errc{errno}, "in io_context::unregister_handle()");
   }
   return status_code::ok;
 }
 
-status io_context::await_in(io_state& state, io_state::task resume) noexcept {
-  return await_op<&io_state::do_in>(epoll_.get(), state, std::move(resume));
+status io_context::arm_in(io_state& state) noexcept {
+  if (backend_ == io_backend::epoll) {
+    if (edge_triggered_) return status_code::ok;
+    return watch(state, true, (bool)state.do_out);
+  }
+  io_state::completion none;
+  io_uring_sqe* sqe = start_uring_op(state, uring_op_kind::poll_in, none);
+  if (!sqe) return error{std::errc::device_or_resource_busy};
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->poll32_events = POLLIN;
+  return status_code::ok;
 }
 
-status io_context::await_out(io_state& state, io_state::task resume) noexcept {
-  return await_op<&io_state::do_out>(epoll_.get(), state, std::move(resume));
+status io_context::arm_out(io_state& state) noexcept {
+  if (backend_ == io_backend::epoll) {
+    if (edge_triggered_) return status_code::ok;
+    return watch(state, (bool)state.do_in, true);
+  }
+  io_state::completion none;
+  io_uring_sqe* sqe = start_uring_op(state, uring_op_kind::poll_out, none);
+  if (!sqe) return error{std::errc::device_or_resource_busy};
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->poll32_events = POLLOUT;
+  return status_code::ok;
+}
+
+status io_context::watch(io_state& state, bool in, bool out) noexcept {
+  epoll_event event;
+  event.events = EPOLLONESHOT | (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+  event.data.ptr = &state;
+  if (epoll_ctl((int)epoll_.get(), EPOLL_CTL_MOD, (int)state.handle, &event) ==
+      -1) {
+    return std::errc{errno};
+  } else {
+    return status_code::ok;
+  }
+}
+
+result<io_context_pool> io_context_pool::create(
+    int size, const io_options& options) noexcept {
+  io_context_pool pool;
+  if (status s = pool.init(size, options); s.failure()) {
+    return error{std::move(s)};
+  }
+  return pool;
+}
+
+io_context_pool::io_context_pool() noexcept {}
+
+status io_context_pool::init(int size, const io_options& options) noexcept {
+  if (size <= 0) size = std::max(1u, std::thread::hardware_concurrency());
+  auto contexts = std::make_unique<io_context[]>(size);
+  for (int i = 0; i < size; i++) {
+    if (status s = contexts[i].init(options); s.failure()) {
+      return error{std::move(s)};
+    }
+  }
+  contexts_ = std::move(contexts);
+  size_ = size;
+  return status_code::ok;
+}
+
+span<io_context> io_context_pool::contexts() const noexcept {
+  return span<io_context>(contexts_.get(), size_);
+}
+
+status io_context_pool::run() {
+  const int num_cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<status> results(size_);
+  const auto run_context = [&](int i) {
+    // Failing to pin a thread only affects performance, so it is not fatal.
+    if (status s = pin_to_core(i % num_cores); s.failure()) {
+      std::cerr << "Cannot pin io_context " << i << ": " << s << '\n';
+    }
+    results[i] = contexts_[i].run();
+    // The pool is only useful while all of its contexts are running, and
+    // run() could not return while the others still were.
+    if (results[i].failure()) {
+      for (int j = 0; j < size_; j++) {
+        if (j != i) contexts_[j].stop();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(size_ - 1);
+  for (int i = 1; i < size_; i++) threads.emplace_back(run_context, i);
+  if (size_ > 0) run_context(0);
+  for (auto& thread : threads) thread.join();
+  for (auto& result : results) {
+    if (result.failure()) return std::move(result);
+  }
+  return status_code::ok;
 }
 
 class address_internals {
@@ -408,7 +1154,7 @@ status socket::init(io_context& context, unique_handle handle) noexcept {
 
 socket::~socket() noexcept {
   if (handle_) {
-    must(context_->unregister_handle(handle_.get()));
+    must(context_->unregister_handle(*state_));
     if (status s = shutdown();
         s.failure() && s != status{std::errc{std::errc::not_connected}}) {
       must(s);
@@ -441,93 +1187,249 @@ stream::stream() noexcept {}
 stream::stream(socket socket) noexcept
     : socket_(std::move(socket)) {}
 
-void stream::read_some(span<char> buffer,
-                       std::function<void(result<span<char>>)> done) noexcept {
+void stream::read_some(
+    span<char> buffer,
+    unique_function<void(result<span<char>>)> done) noexcept {
   auto& state = socket_.state();
-  auto handler = [&state, buffer, done] {
-    int result = ::read((int)state.handle, buffer.data(), buffer.size());
-    if (result != -1) {
-      done(buffer.subspan(0, result));
-    } else {
-      done(error{std::errc{errno}});
-    }
-  };
-  if (status s = socket_.context().await_in(state, std::move(handler));
-      !s.success()) {
-    done(error{std::move(s)});
+  read_some_op op{&state, buffer, std::move(done)};
+  if (try_direct(socket_.context(), op)) return;
+  if (socket_.context().backend() == io_backend::io_uring) {
+    socket_.context().submit_recv(
+        state, buffer,
+        [op = std::move(op)](int result) mutable { op.complete(result); });
+    return;
   }
+  retry_op<read_some_op>::await({&socket_.context(), std::move(op)});
+}
+
+void stream::await_readable(unique_function<void(status)> done) noexcept {
+  start(socket_.context(),
+        await_readable_op{&socket_.state(), std::move(done)});
+}
+
+void stream::read_some(
+    span<const span<char>> buffers,
+    unique_function<void(result<std::size_t>)> done) noexcept {
+  auto& state = socket_.state();
+  start(socket_.context(), scatter_read_op{&state, buffers, std::move(done)});
 }
 
 void stream::read(span<char> buffer,
-                  std::function<void(result<span<char>>)> done) noexcept {
-  // read is composed of a sequence of read_some calls.
+                  unique_function<void(result<span<char>>)> done) noexcept {
+  // read is composed of a sequence of read_some calls. The state is allocated
+  // once up front so that each step only needs to pass along a pointer.
   struct reader {
     stream* input;
     span<char> buffer;
-    std::function<void(result<span<char>>)> done;
+    unique_function<void(result<span<char>>)> done;
     span<char>::size_type bytes_read = 0;
-    void run() {
-      input->read_some(buffer.subspan(bytes_read), *this);
+
+    static void run(std::unique_ptr<reader> self) noexcept {
+      reader& r = *self;
+      r.input->read_some(
+          r.buffer.subspan(r.bytes_read),
+          [self = std::move(self)](result<span<char>> result) mutable {
+            step(std::move(self), std::move(result));
+          });
     }
-    void operator()(result<span<char>> result) {
+
+    static void step(std::unique_ptr<reader> self,
+                     result<span<char>> result) noexcept {
       if (result.failure()) {
-        done(std::move(result));
+        self->done(std::move(result));
+        return;
+      }
+      if (result->empty()) {
+        self->done(error{std::errc::connection_aborted});
         return;
       }
-      bytes_read += result->size();
-      if (bytes_read < buffer.size()) {
-        run();
+      self->bytes_read += result->size();
+      if (self->bytes_read < self->buffer.size()) {
+        run(std::move(self));
       } else {
-        done(buffer);
+        self->done(self->buffer);
       }
     }
   };
-  reader{this, buffer, std::move(done)}.run();
+  reader::run(std::make_unique<reader>(reader{this, buffer, std::move(done)}));
 }
 
 void stream::write_some(
     span<const char> buffer,
-    std::function<void(result<span<const char>>)> done) noexcept {
+    unique_function<void(result<span<const char>>)> done) noexcept {
   auto& state = socket_.state();
-  auto handler = [&state, buffer, done] {
-    int result =
-        ::send((int)state.handle, buffer.data(), buffer.size(), MSG_NOSIGNAL);
-    if (result != -1) {
-      done(buffer.subspan(result));
-    } else {
-      done(error{std::errc{errno}});
-    }
-  };
-  if (status s = socket_.context().await_out(state, std::move(handler));
-      !s.success()) {
-    done(error{std::move(s)});
+  write_some_op op{&state, buffer, std::move(done)};
+  if (try_direct(socket_.context(), op)) return;
+  if (socket_.context().backend() == io_backend::io_uring) {
+    socket_.context().submit_send(
+        state, buffer,
+        [op = std::move(op)](int result) mutable { op.complete(result); });
+    return;
   }
+  retry_op<write_some_op>::await({&socket_.context(), std::move(op)});
+}
+
+void stream::write_some(
+    span<const span<const char>> buffers,
+    unique_function<void(result<std::size_t>)> done) noexcept {
+  auto& state = socket_.state();
+  start(socket_.context(),
+        gather_write_op{&state, buffers, 0, std::move(done)});
 }
 
 void stream::write(span<const char> buffer,
-                   std::function<void(status)> done) noexcept {
-  // write is composed of a sequence of write_some calls.
+                   unique_function<void(status)> done) noexcept {
+  // write is composed of a sequence of write_some calls. The state is
+  // allocated once up front so that each step only needs to pass along a
+  // pointer.
   struct writer {
     stream* output;
     span<const char> remaining;
-    std::function<void(status)> done;
-    void run() {
-      output->write_some(remaining, *this);
+    unique_function<void(status)> done;
+
+    static void run(std::unique_ptr<writer> self) noexcept {
+      writer& w = *self;
+      w.output->write_some(
+          w.remaining,
+          [self = std::move(self)](result<span<const char>> result) mutable {
+            step(std::move(self), std::move(result));
+          });
     }
-    void operator()(result<span<const char>> result) {
+
+    static void step(std::unique_ptr<writer> self,
+                     result<span<const char>> result) noexcept {
       if (result.failure()) {
-        done(std::move(result).status());
+        self->done(std::move(result).status());
         return;
       }
-      remaining = *result;
-      if (!remaining.empty()) {
-        run();
+      self->remaining = *result;
+      if (!self->remaining.empty()) {
+        run(std::move(self));
       } else {
-        done(status_code::ok);
+        self->done(status_code::ok);
+      }
+    }
+  };
+  writer::run(std::make_unique<writer>(writer{this, buffer, std::move(done)}));
+}
+
+status stream::shutdown() noexcept { return socket_.shutdown(); }
+
+status stream::set_no_delay(bool enable) noexcept {
+  int value = enable;
+  int r = setsockopt((int)socket_.handle(), IPPROTO_TCP, TCP_NODELAY, &value,
+                     sizeof(int));
+  if (r == -1) return status(std::errc{errno}, "in stream::set_no_delay()");
+  return status_code::ok;
+}
+
+void stream::cancel_read(std::errc reason) noexcept {
+  socket_.context().cancel_in(socket_.state(), reason);
+}
+
+void stream::clear_cancel_read() noexcept {
+  socket_.state().in_cancelled = std::errc{};
+}
+
+void stream::cancel_write(std::errc reason) noexcept {
+  socket_.context().cancel_out(socket_.state(), reason);
+}
+
+void stream::write(span<const span<const char>> buffers,
+                   unique_function<void(status)> done) noexcept {
+  // Each step writes as many of the remaining buffers as possible with a
+  // single sendmsg() call, and then skips past whatever was written.
+  struct writer {
+    stream* output;
+    span<const span<const char>> buffers;
+    std::size_t offset = 0;
+    unique_function<void(status)> done;
+
+    static void run(std::unique_ptr<writer> self) noexcept {
+      // Skip over empty buffers so that every write makes progress.
+      while (!self->buffers.empty() &&
+             self->offset == self->buffers[0].size()) {
+        self->buffers = self->buffers.subspan(1);
+        self->offset = 0;
+      }
+      if (self->buffers.empty()) {
+        self->done(status_code::ok);
+        return;
+      }
+      writer& w = *self;
+      auto& state = w.output->socket_.state();
+      start(w.output->context(),
+            gather_write_op{
+                &state, w.buffers, w.offset,
+                [self = std::move(self)](result<std::size_t> result) mutable {
+                  step(std::move(self), std::move(result));
+                }});
+    }
+
+    static void step(std::unique_ptr<writer> self,
+                     result<std::size_t> result) noexcept {
+      if (result.failure()) {
+        self->done(std::move(result).status());
+        return;
+      }
+      std::size_t written = *result;
+      while (written > 0) {
+        const std::size_t n =
+            std::min(written, self->buffers[0].size() - self->offset);
+        written -= n;
+        self->offset += n;
+        if (self->offset == self->buffers[0].size()) {
+          self->buffers = self->buffers.subspan(1);
+          self->offset = 0;
+        }
       }
+      run(std::move(self));
     }
   };
-  writer{this, buffer, std::move(done)}.run();
+  writer::run(std::make_unique<writer>(
+      writer{this, buffers, 0, std::move(done)}));
+}
+
+void stream::send_file(span<const char> prefix, file_range file,
+                       unique_function<void(status)> done) noexcept {
+  struct sender {
+    stream* output;
+    span<const char> prefix;
+    file_range file;
+    unique_function<void(status)> done;
+
+    static void run(std::unique_ptr<sender> self) noexcept {
+      if (self->prefix.empty() && self->file.size == 0) {
+        self->done(status_code::ok);
+        return;
+      }
+      sender& s = *self;
+      auto& state = s.output->socket_.state();
+      start(s.output->context(),
+            send_file_op{
+                &state, s.prefix, s.file,
+                [self = std::move(self)](result<std::size_t> result) mutable {
+                  step(std::move(self), std::move(result));
+                }});
+    }
+
+    static void step(std::unique_ptr<sender> self,
+                     result<std::size_t> result) noexcept {
+      if (result.failure()) {
+        self->done(std::move(result).status());
+        return;
+      }
+      std::size_t sent = *result;
+      const std::size_t from_prefix = std::min(sent, self->prefix.size());
+      self->prefix = self->prefix.subspan(from_prefix);
+      sent -= from_prefix;
+      self->file.offset += sent;
+      self->file.size -= sent;
+      run(std::move(self));
+    }
+  };
+  sender::run(std::make_unique<sender>(
+      sender{this, prefix, file, std::move(done)}));
 }
 
 stream::operator bool() const noexcept { return (bool)socket_; }
@@ -536,32 +1438,39 @@ io_context& stream::context() const noexcept { return socket_.context(); }
 acceptor::acceptor() noexcept {}
 acceptor::acceptor(socket socket) noexcept : socket_(std::move(socket)) {}
 
-void acceptor::accept(std::function<void(result<stream>)> done) noexcept {
+void acceptor::accept(unique_function<void(result<stream>)> done) noexcept {
   auto& state = socket_.state();
-  auto handler = [&context = socket_.context(), &state, done] {
-    int handle = ::accept4((int)state.handle, nullptr, nullptr, SOCK_NONBLOCK);
-    if (handle == -1) {
-      done(error{std::errc{errno}});
-      return;
-    }
-    result<socket> s =
-        socket::create(context, unique_handle{file_handle{handle}});
-    if (s.success()) {
-      done(std::move(*s));
-    } else {
-      done(error{std::move(s).status()});
-    }
-  };
-  if (status s = socket_.context().await_in(state, std::move(handler));
-      !s.success()) {
-    done(error{std::move(s)});
+  accept_op op{&socket_.context(), &state, std::move(done)};
+  if (try_direct(socket_.context(), op)) return;
+  if (socket_.context().backend() == io_backend::io_uring) {
+    socket_.context().submit_accept(
+        state,
+        [op = std::move(op)](int result) mutable { op.complete(result); });
+    return;
   }
+  retry_op<accept_op>::await({&socket_.context(), std::move(op)});
+}
+
+result<stream> acceptor::try_accept() noexcept {
+  auto& state = socket_.state();
+  const int handle =
+      ::accept4((int)state.handle, nullptr, nullptr, SOCK_NONBLOCK);
+  if (handle == -1) {
+    const int code = errno;
+    if (would_block(code)) state.readable = false;
+    return error{std::errc{code}};
+  }
+  result<socket> s =
+      socket::create(socket_.context(), unique_handle{file_handle{handle}});
+  if (s.failure()) return error{std::move(s).status()};
+  return stream{std::move(*s)};
 }
 
 acceptor::operator bool() const noexcept { return (bool)socket_; }
 io_context& acceptor::context() const noexcept { return socket_.context(); }
 
-result<acceptor> bind(io_context& context, const address& address) {
+result<acceptor> bind(io_context& context, const address& address,
+                      const bind_options& options) {
   const addrinfo* const info = address_internals::get(address);
   // Create a socket in the right address family (e.g. IPv4 or IPv6).
   result<socket> socket = socket::create(
@@ -580,13 +1489,20 @@ result<acceptor> bind(io_context& context, const address& address) {
   if (status s = allow_address_reuse(*socket); s.failure()) {
     return error{std::move(s)};
   }
+  // Allow other acceptors to share the same address so that connections can be
+  // spread across several io_contexts.
+  if (options.reuse_port) {
+    if (status s = allow_port_reuse(*socket); s.failure()) {
+      return error{std::move(s)};
+    }
+  }
   // Bind to the address.
   const int bind_result =
       ::bind((int)socket->handle(), info->ai_addr, info->ai_addrlen);
   if (bind_result == -1) return error{std::errc{errno}};
   // Start listening for incoming connections.
   const int listen_result =
-      ::listen((int)socket->handle(), acceptor::max_pending_connections);
+      ::listen((int)socket->handle(), options.backlog);
   if (listen_result == -1) return error{std::errc{errno}};
   return acceptor{std::move(*socket)};
 }
@@ -4,8 +4,12 @@
 #include "result.h"
 #include "span.h"
 #include "status.h"
+#include "uring.h"
 
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <system_error>
 
 namespace util {
 
@@ -35,55 +39,324 @@ class unique_handle {
   file_handle handle_;
 };
 
+// A range of bytes within a file.
+struct file_range {
+  file_handle handle = file_handle::none;
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+};
+
+// The mechanism that an io_context uses for performing IO.
+enum class io_backend {
+  // Wait for file handles to become ready with epoll, and then perform each
+  // operation with a regular system call.
+  epoll,
+  // Submit operations to the kernel in batches through an io_uring, and
+  // receive their results as completions. If io_uring is not available, the
+  // io_context falls back to epoll.
+  io_uring,
+};
+
+struct io_options {
+  io_backend backend = io_backend::epoll;
+  // Attempt stream and acceptor operations immediately, and only wait for the
+  // file handle to become ready if the operation would block.
+  bool direct_io = true;
+  // With epoll, register each handle for both directions once, in
+  // edge-triggered mode, rather than re-arming a one-shot registration for
+  // every operation. The readiness of each handle is tracked in its io_state.
+  bool edge_triggered = true;
+  // The maximum number of tasks (ready tasks and expired timers together) to
+  // run in one iteration of the event loop before checking for IO again, so
+  // that a steady stream of ready work cannot starve IO.
+  std::size_t max_tasks_per_iteration = 256;
+};
+
+// Statistics about the event loop of an io_context.
+struct io_loop_stats {
+  // The number of iterations of the loop, and the number of those which ran
+  // out of budget before running every task that was ready.
+  std::uint64_t iterations = 0;
+  std::uint64_t budget_exhausted = 0;
+  // The total number of tasks and expired timers that have been run.
+  std::uint64_t tasks_run = 0;
+  // The length of the ready queue at the start of the most recent iteration,
+  // and the longest it has been at the start of any iteration.
+  std::size_t ready_depth = 0;
+  std::size_t max_ready_depth = 0;
+  // Total time spent in each phase of the loop: running expired timers,
+  // running ready tasks, and waiting for and dispatching IO.
+  executor::duration timer_time = {};
+  executor::duration ready_time = {};
+  executor::duration poll_time = {};
+};
+
 // State for pending IO operations in an IO context. See the functions in
 // io_context for more information.
 struct io_state {
   using task = executor::task;
+  // Receives the result of a completion-based operation: either the
+  // non-negative return value of the system call, or a negated errno value.
+  using completion = unique_function<void(int), 2 * default_function_storage>;
   file_handle handle;
   task do_in;
   task do_out;
+  // Identifiers for outstanding io_uring operations in each direction.
+  std::uint64_t uring_in = 0;
+  std::uint64_t uring_out = 0;
+  // With edge-triggered epoll, whether the handle may be ready for each
+  // direction. These are set when epoll reports readiness and cleared when an
+  // operation finds that it would block.
+  bool readable = false;
+  bool writable = false;
+  // If non-zero, the operation in each direction has been cancelled and will
+  // fail with this error. See io_context::cancel_in().
+  std::errc in_cancelled = {};
+  std::errc out_cancelled = {};
 };
 
 class io_context : public executor {
  public:
   // Equivalent to constructing an io_context and calling init().
-  static result<io_context> create() noexcept;
+  static result<io_context> create(const io_options& options = {}) noexcept;
 
   // Construct an uninitialized io_context.
   io_context() noexcept;
+  ~io_context() noexcept;
+
+  // Not copyable.
+  io_context(const io_context&) = delete;
+  io_context& operator=(const io_context&) = delete;
+
+  // Movable, but not while it is running or while any other thread may post
+  // to it.
+  io_context(io_context&&) noexcept;
+  io_context& operator=(io_context&&) noexcept;
+
   // Initialize the io_context. This must be called before any other operation
   // is performed.
-  status init() noexcept;
+  status init(const io_options& options = {}) noexcept;
 
-  // Schedule a task to run in this context.
-  void schedule_at(time_point, task) noexcept override;
+  // Returns the backend which is in use. This may differ from the requested
+  // backend if it was not available.
+  io_backend backend() const noexcept;
+
+  // Schedule a task to run in this context. Tasks which are to run now are
+  // kept in a FIFO ready queue, apart from the timers, and cannot be
+  // cancelled.
+  timer schedule_at(time_point, task) noexcept override;
+  timer schedule(task) noexcept override;
+
+  // Schedule a task to run in this context from any thread. Posted tasks join
+  // the ready queue in the order that they were posted (for each thread), at
+  // the start of the next iteration of the event loop. If the context is
+  // blocked waiting for IO, it is woken up through an eventfd; otherwise,
+  // posting does not make any system calls.
+  void post(task) noexcept;
 
   // Run work in this io_context.
   status run();
 
+  // Make run() return successfully, from any thread. The context stops once
+  // it has run the tasks which were posted before this, and can be run again
+  // afterwards.
+  void stop() noexcept;
+
+  // Statistics about the event loop. These are updated by run(), so they must
+  // only be read from the thread running the context (for example, by a task
+  // scheduled on it).
+  const io_loop_stats& stats() const noexcept { return stats_; }
+
   // IO state is maintained in io_state objects. Before any IO can be performed
   // for a file handle, an io_state must be registered. Once IO for a file
   // handle is complete, it must be unregistered.
   status register_handle(io_state& state) noexcept;
-  status unregister_handle(file_handle handle) noexcept;
+  status unregister_handle(io_state& state) noexcept;
 
   // Await an operation on this file stream. The state must have been registered
   // before these functions are called. The provided task will be scheduled as
   // soon as the file handle is ready to perform the corresponding operation, so
-  // this can be used to schedule a read()/accept()/write() call for later.
-  status await_in(io_state& state, io_state::task) noexcept;
-  status await_out(io_state& state, io_state::task) noexcept;
+  // this can be used to schedule a read()/accept()/write() call for later. If
+  // the handle is already known to be ready, the task is scheduled straight
+  // away. If the operation cannot be awaited, an error is returned and the task
+  // is left untouched so that the caller can still use anything it owns.
+  template <typename F>
+  status await_in(io_state& state, F&& resume) noexcept {
+    if (state.readable) {
+      schedule(std::forward<F>(resume));
+      return status_code::ok;
+    }
+    if (status s = arm_in(state); s.failure()) return s;
+    state.do_in = std::forward<F>(resume);
+    return status_code::ok;
+  }
+  template <typename F>
+  status await_out(io_state& state, F&& resume) noexcept {
+    if (state.writable) {
+      schedule(std::forward<F>(resume));
+      return status_code::ok;
+    }
+    if (status s = arm_out(state); s.failure()) return s;
+    state.do_out = std::forward<F>(resume);
+    return status_code::ok;
+  }
+
+  // Completion-based operations, which are only available with the io_uring
+  // backend. Each operation is submitted to the kernel along with the next
+  // batch, and its completion is invoked with the result of the corresponding
+  // system call once it finishes. A state can have at most one outstanding
+  // operation or await in each direction.
+  void submit_recv(io_state& state, span<char> buffer,
+                   io_state::completion) noexcept;
+  void submit_send(io_state& state, span<const char> buffer,
+                   io_state::completion) noexcept;
+  void submit_accept(io_state& state, io_state::completion) noexcept;
+
+  // Cancel the operation in one direction for the state, so that it fails
+  // with the given error instead. If no operation is pending, the next one to
+  // be started in that direction fails instead. Cancellation is asynchronous:
+  // a pending continuation is invoked from a fresh task (or, with io_uring,
+  // once the kernel has stopped the operation), and an operation which is
+  // already completing may still succeed, in which case the cancellation
+  // carries over to the next operation. This only costs a few stores, so
+  // timers can use it to enforce a deadline on every connection.
+  void cancel_in(io_state& state, std::errc reason) noexcept;
+  void cancel_out(io_state& state, std::errc reason) noexcept;
+
+  // With direct IO, operations are attempted before waiting for readiness. An
+  // operation which completes at once invokes its continuation inline, which
+  // may start another operation, so the number of nested inline completions is
+  // limited to keep the stack bounded. Beyond the limit, operations go through
+  // the event loop as usual.
+  static constexpr int max_inline_depth = 8;
+  bool can_complete_inline() const noexcept {
+    return direct_io_ && inline_depth_ < max_inline_depth;
+  }
+  // Tracks the nesting of inline completions for as long as it is alive.
+  class inline_scope {
+   public:
+    explicit inline_scope(io_context& context) noexcept : context_(context) {
+      context_.inline_depth_++;
+    }
+    ~inline_scope() noexcept { context_.inline_depth_--; }
+    inline_scope(const inline_scope&) = delete;
+    inline_scope& operator=(const inline_scope&) = delete;
+
+   private:
+    io_context& context_;
+  };
 
  private:
-  struct work_item {
-    time_point time;
-    task resume;
+  enum class uring_op_kind { poll_in, poll_out, recv, send, accept };
+
+  // An outstanding io_uring operation.
+  struct uring_op {
+    // The state that the operation is for. This is null if the state has been
+    // unregistered since the operation was submitted, in which case the
+    // completion is discarded when the operation finishes.
+    io_state* state = nullptr;
+    uring_op_kind kind = uring_op_kind::poll_in;
+    io_state::completion done;
+    std::uint32_t generation = 0;
+    std::uint32_t next_free = 0;
   };
 
   io_context(unique_handle epoll) noexcept;
 
+  // Start waiting for the state to become ready for input or output.
+  status arm_in(io_state& state) noexcept;
+  status arm_out(io_state& state) noexcept;
+
+  // Update the set of operations which the state is waiting for in epoll.
+  status watch(io_state& state, bool in, bool out) noexcept;
+
+  // Tasks posted from other threads, along with the means of waking up the
+  // context to run them.
+  struct remote_queue;
+
+  // Start waiting for a wakeup with the io_uring backend.
+  void submit_wakeup() noexcept;
+  // Move any posted tasks onto the ready queue.
+  void take_posted() noexcept;
+  // Record that the context is about to block waiting for IO, unless tasks
+  // have been posted in the meantime. Returns true if the context may block.
+  bool prepare_to_sleep() noexcept;
+
+  // Run up to the given number of expired timers or ready tasks, returning the
+  // number that were run.
+  std::size_t run_timers(std::size_t budget) noexcept;
+  std::size_t run_ready(std::size_t budget) noexcept;
+  // Returns how long to wait for IO before the next work is due, in
+  // milliseconds, or -1 if there is no pending work.
+  int poll_timeout(time_point now) const noexcept;
+
+  // Wait for IO with the given timeout and dispatch any results.
+  status poll_epoll(int timeout_ms) noexcept;
+  status poll_uring(int timeout_ms) noexcept;
+
+  // Get a submission queue entry, flushing the queue if it is full. Returns
+  // null if no entry is available.
+  io_uring_sqe* get_sqe() noexcept;
+  // Record an operation and return a submission queue entry for it, with its
+  // user data filled in. If the queue is full, returns null and leaves the
+  // completion untouched.
+  io_uring_sqe* start_uring_op(io_state&, uring_op_kind,
+                               io_state::completion&) noexcept;
+  // Handle a completion from the io_uring.
+  void finish_uring_op(const uring_completion&) noexcept;
+  // Translate the result of an operation which may have been cancelled.
+  static int cancelled_result(std::errc& reason, int result) noexcept;
+  // Wake a task waiting for readiness and cancel an io_uring operation, in
+  // one direction.
+  void cancel_op(task& resume, std::uint64_t uring_op) noexcept;
+
+  bool cancel(timer_id) noexcept override;
+
+  io_backend backend_ = io_backend::epoll;
+  bool direct_io_ = true;
+  bool edge_triggered_ = true;
+  int inline_depth_ = 0;
   unique_handle epoll_;
-  std::vector<work_item> work_;
+  uring uring_;
+  std::vector<uring_op> uring_ops_;
+  std::uint32_t free_uring_op_ = 0;
+  std::size_t max_tasks_per_iteration_ = 256;
+  timer_wheel<task> timers_;
+  std::deque<task> ready_;
+  std::unique_ptr<remote_queue> remote_;
+  bool stopping_ = false;
+  io_loop_stats stats_;
+};
+
+// A fixed set of io_contexts, each of which runs on its own thread. This allows
+// IO to be spread across multiple cores: each context has its own epoll
+// instance and its own work queue, so no synchronization is required between
+// them as long as each socket is only ever used from the context that owns it.
+class io_context_pool {
+ public:
+  // Equivalent to constructing an io_context_pool and calling init().
+  static result<io_context_pool> create(
+      int size, const io_options& options = {}) noexcept;
+
+  // Construct an empty io_context_pool.
+  io_context_pool() noexcept;
+  // Initialize the pool with the given number of contexts. If size is not
+  // positive, one context is created for each available hardware thread.
+  status init(int size, const io_options& options = {}) noexcept;
+
+  // Access the contexts in this pool. The contexts are owned by the pool and
+  // remain at a stable address for its entire lifetime.
+  span<io_context> contexts() const noexcept;
+
+  // Run every context in the pool, each on its own thread pinned to its own
+  // CPU core. The calling thread is used for the first context. Returns once
+  // all contexts have stopped running, with the first failure (if any). If
+  // any context fails, the others are stopped.
+  status run();
+
+ private:
+  std::unique_ptr<io_context[]> contexts_;
+  int size_ = 0;
 };
 
 class address_internals;
@@ -170,24 +443,117 @@ class stream {
 
   // Asynchronously read data from the stream into the provided buffer. The
   // continuation function will be invoked either with a status describing the
-  // failure or a non-empty span of bytes that were read.
+  // failure or a span of bytes that were read, which is only empty if the peer
+  // has closed the stream.
   void read_some(span<char> buffer,
-                 std::function<void(result<span<char>>)> done) noexcept;
+                 unique_function<void(result<span<char>>)> done) noexcept;
+  // Wait until the stream is readable, without reading anything. This allows
+  // a caller to avoid holding a buffer while it waits for data to arrive. The
+  // stream is also readable once it has been closed.
+  void await_readable(unique_function<void(status)> done) noexcept;
+  // Read data from the stream into a sequence of buffers with a single
+  // system call, filling each buffer before moving on to the next. The
+  // continuation function receives the total number of bytes read, which is
+  // only zero if the peer has closed the stream. The list of buffers must
+  // remain valid until the continuation is invoked.
+  void read_some(span<const span<char>> buffers,
+                 unique_function<void(result<std::size_t>)> done) noexcept;
+
   // Like read_some, but will keep trying until it fills the entire buffer or
-  // gets an error.
+  // gets an error. Reaching the end of the stream first is an error.
   void read(span<char> buffer,
-            std::function<void(result<span<char>>)> done) noexcept;
+            unique_function<void(result<span<char>>)> done) noexcept;
 
   // Asynchronously write data from the provided buffer to the stream. The
   // continuation function will be invoked either with a status describing the
   // failure or with a span of yet-to-be-written bytes which is at least one
   // byte smaller than the input.
-  void write_some(span<const char> buffer,
-                  std::function<void(result<span<const char>>)> done) noexcept;
+  void write_some(
+      span<const char> buffer,
+      unique_function<void(result<span<const char>>)> done) noexcept;
+  // Write data from a sequence of buffers to the stream with a single system
+  // call. The continuation function receives the total number of bytes
+  // written, which may end part-way through any of the buffers. The list of
+  // buffers must remain valid until the continuation is invoked.
+  void write_some(span<const span<const char>> buffers,
+                  unique_function<void(result<std::size_t>)> done) noexcept;
   // Like write_some, but will keep trying until everything is written or an
   // error occurs.
   void write(span<const char> buffer,
-             std::function<void(status)> done) noexcept;
+             unique_function<void(status)> done) noexcept;
+  // Write a sequence of buffers to the stream, in order, with as few system
+  // calls as possible by gathering them into a single write. The buffers and
+  // the list of buffers must remain valid until the continuation is invoked.
+  void write(span<const span<const char>> buffers,
+             unique_function<void(status)> done) noexcept;
+
+  // Write the prefix followed by a range of bytes from a file. The file data is
+  // copied directly from the page cache to the socket with sendfile(), so it
+  // never passes through userspace. The prefix must remain valid and the file
+  // must remain open until the continuation is invoked.
+  void send_file(span<const char> prefix, file_range file,
+                 unique_function<void(status)> done) noexcept;
+
+  // Awaitable versions of the operations above, for use in coroutines. Each
+  // one resumes the coroutine with the value which would have been passed to
+  // the continuation, and has the same requirements on the lifetime of its
+  // arguments.
+  auto read_some(span<char> buffer) noexcept {
+    return await_callback<result<span<char>>>(
+        [this, buffer](auto done) { read_some(buffer, std::move(done)); });
+  }
+  auto await_readable() noexcept {
+    return await_callback<status>(
+        [this](auto done) { await_readable(std::move(done)); });
+  }
+  auto read_some(span<const span<char>> buffers) noexcept {
+    return await_callback<result<std::size_t>>(
+        [this, buffers](auto done) { read_some(buffers, std::move(done)); });
+  }
+  auto read(span<char> buffer) noexcept {
+    return await_callback<result<span<char>>>(
+        [this, buffer](auto done) { read(buffer, std::move(done)); });
+  }
+  auto write_some(span<const char> buffer) noexcept {
+    return await_callback<result<span<const char>>>(
+        [this, buffer](auto done) { write_some(buffer, std::move(done)); });
+  }
+  auto write_some(span<const span<const char>> buffers) noexcept {
+    return await_callback<result<std::size_t>>(
+        [this, buffers](auto done) { write_some(buffers, std::move(done)); });
+  }
+  auto write(span<const char> buffer) noexcept {
+    return await_callback<status>(
+        [this, buffer](auto done) { write(buffer, std::move(done)); });
+  }
+  auto write(span<const span<const char>> buffers) noexcept {
+    return await_callback<status>(
+        [this, buffers](auto done) { write(buffers, std::move(done)); });
+  }
+  auto send_file(span<const char> prefix, file_range file) noexcept {
+    return await_callback<status>([this, prefix, file](auto done) {
+      send_file(prefix, file, std::move(done));
+    });
+  }
+
+  // Shut down both directions of the stream. Any pending read will complete
+  // with an empty span.
+  status shutdown() noexcept;
+
+  // Send small writes immediately instead of holding them back (with Nagle's
+  // algorithm) until earlier data has been acknowledged. This suits protocols
+  // which send many small messages, each of which should arrive promptly.
+  status set_no_delay(bool enable) noexcept;
+
+  // Make the pending read or write (or the next one, if there is none) fail
+  // with the given error, such as std::errc::timed_out when a deadline passes.
+  // See io_context::cancel_in() for the details.
+  void cancel_read(std::errc reason) noexcept;
+  void cancel_write(std::errc reason) noexcept;
+  // Discard a cancellation from cancel_read() which has not taken effect,
+  // because the read that it was meant for completed first. Only valid while
+  // no read is pending.
+  void clear_cancel_read() noexcept;
 
   // Check if the socket is initialised (non-empty).
   explicit operator bool() const noexcept;
@@ -203,15 +569,22 @@ class stream {
 // A TCP server, accepting TCP sockets.
 class acceptor {
  public:
-  static constexpr int max_pending_connections = 8;
-
   acceptor() noexcept;
   acceptor(socket socket) noexcept;
 
   // Asynchronously accept a new connection. On success, returns the newly
   // established stream. On failure, returns an error code explaining what went
   // wrong.
-  void accept(std::function<void(result<stream>)> done) noexcept;
+  void accept(unique_function<void(result<stream>)> done) noexcept;
+  // Accept a connection which is already waiting, without blocking. If there
+  // is none, this fails with std::errc::resource_unavailable_try_again. This
+  // allows a caller to drain a burst of connections after accept() completes.
+  result<stream> try_accept() noexcept;
+  // Awaitable version of accept(), for use in coroutines.
+  auto accept() noexcept {
+    return await_callback<result<stream>>(
+        [this](auto done) { accept(std::move(done)); });
+  }
 
   // Check if the socket is initialised (non-empty).
   explicit operator bool() const noexcept;
@@ -224,8 +597,19 @@ class acceptor {
   socket socket_;
 };
 
+struct bind_options {
+  // Set SO_REUSEPORT on the listening socket. This allows several acceptors
+  // (typically one per io_context) to bind to the same address, with the
+  // kernel distributing incoming connections between them.
+  bool reuse_port = false;
+  // The maximum number of connections which may be waiting to be accepted.
+  // The kernel silently caps this at net.core.somaxconn.
+  int backlog = 1024;
+};
+
 // Host: bind an acceptor to the given address.
-result<acceptor> bind(io_context&, const address&);
+result<acceptor> bind(io_context&, const address&,
+                      const bind_options& options = {});
 
 // Client: connect a stream to the given address.
 result<stream> connect(io_context&, const address&);
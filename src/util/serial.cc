@@ -1,22 +1,22 @@
 #include "serial.h"
 
+#include <string>
+
 namespace util {
+namespace detail {
 
-void encoder<unsigned int>::operator() (const unsigned int& value) const noexcept {
-  static_assert(sizeof(value) == 4);
-  *out_stream_ << (value >> 24);
-  *out_stream_ << (value >> 16);
-  *out_stream_ << (value >> 8);
-  *out_stream_ << (value);
+error encode_buffer_too_small(std::size_t needed,
+                              std::size_t available) noexcept {
+  return error{status(std::errc::no_buffer_space,
+                      "encoding needs " + std::to_string(needed) +
+                          " bytes, but only " + std::to_string(available) +
+                          " are available")};
 }
 
-/*encoder<float> operator() (char& value) const noexcept {
-  // TODO
-}*/
-
-void encoder<char>::operator() (const char& value) const noexcept {
-  *out_stream_ << value;
+error decode_error(const char* message) noexcept {
+  return error{status(std::errc::bad_message, message)};
 }
 
-}  // namespace util
+}  // namespace detail
 
+}  // namespace util
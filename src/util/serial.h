@@ -1,58 +1,687 @@
 #pragma once
-  
-#include <iostream>
+
+#include "result.h"
+#include "span.h"
+#include "status.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 namespace util {
 
-// Common to all encoders
-class encoder_base {
+// A binary serialization format. Every value is encoded in two passes: the
+// first computes the exact size of the encoding, so that the output can be
+// allocated (or checked) once, and the second writes the bytes without any
+// further checks. Decoding checks the bounds of the input as few times as
+// possible: once for a fixed size value, or once for a whole sequence of
+// them.
+//
+// The wire format is:
+//   * Integers, bools and chars: fixed width, little-endian.
+//   * float and double: their IEEE 754 bits, as a fixed width integer.
+//   * varint<T>: LEB128, with signed values zigzag-encoded first.
+//   * Strings, vectors and spans: a varint length followed by the elements.
+//   * std::array: the elements, without a length.
+
+// Wraps an integer so that it is encoded as a variable-length integer, which
+// takes fewer bytes for small values. Signed values are zigzag-encoded, so
+// small negative values are short too.
+template <typename T>
+struct varint {
+  static_assert(std::is_integral_v<T>);
+  T value;
+  bool operator==(const varint&) const = default;
+};
+
+namespace detail {
+
+// The unsigned integer type with the given size in bytes.
+template <std::size_t size>
+using unsigned_of_size = std::conditional_t<
+    size == 1, std::uint8_t,
+    std::conditional_t<size == 2, std::uint16_t,
+                       std::conditional_t<size == 4, std::uint32_t,
+                                          std::uint64_t>>>;
+
+template <typename T>
+T byteswap(T value) noexcept {
+  static_assert(std::is_unsigned_v<T>);
+  if constexpr (sizeof(T) == 1) {
+    return value;
+  } else if constexpr (sizeof(T) == 2) {
+    return __builtin_bswap16(value);
+  } else if constexpr (sizeof(T) == 4) {
+    return __builtin_bswap32(value);
+  } else {
+    static_assert(sizeof(T) == 8);
+    return __builtin_bswap64(value);
+  }
+}
+
+}  // namespace detail
+
+// Where encoders write their output. Space for the whole encoding has already
+// been reserved by the time anything is written, so writes are not checked.
+class byte_writer {
  public:
-    encoder_base(std::ostream& target_stream) noexcept
-      : out_stream_(&target_stream) {}
- protected:
-    std::ostream* out_stream_;
+  explicit byte_writer(char* position) noexcept : position_(position) {}
+
+  char* position() const noexcept { return position_; }
+
+  void write(const void* data, std::size_t size) noexcept {
+    std::memcpy(position_, data, size);
+    position_ += size;
+  }
+
+  // Write an unsigned integer in little-endian byte order.
+  template <typename T>
+  void write_little_endian(T value) noexcept {
+    static_assert(std::is_unsigned_v<T>);
+    if constexpr (std::endian::native == std::endian::little) {
+      write(&value, sizeof(T));
+    } else {
+      for (std::size_t i = 0; i < sizeof(T); i++) {
+        *position_++ = (char)(value >> (8 * i));
+      }
+    }
+  }
+
+  // Write an array of integers or floating point values, each in
+  // little-endian byte order. On a big-endian machine the bytes are swapped
+  // in a loop which the compiler can vectorize into byte shuffles (the
+  // elements are loaded with memcpy, since a bit_cast of a float prevents
+  // that).
+  template <typename T>
+  void write_little_endian(const T* values, std::size_t count) noexcept {
+    static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>);
+    if (count == 0) return;  // values may be null.
+    if constexpr (std::endian::native == std::endian::little) {
+      write(values, count * sizeof(T));
+    } else {
+      using bits = detail::unsigned_of_size<sizeof(T)>;
+      for (std::size_t i = 0; i < count; i++) {
+        bits value;
+        std::memcpy(&value, values + i, sizeof(T));
+        value = detail::byteswap(value);
+        std::memcpy(position_ + i * sizeof(T), &value, sizeof(T));
+      }
+      position_ += count * sizeof(T);
+    }
+  }
+
+  void write_varint(std::uint64_t value) noexcept {
+    while (value >= 0x80) {
+      *position_++ = (char)(value | 0x80);
+      value >>= 7;
+    }
+    *position_++ = (char)value;
+  }
+
+ private:
+  char* position_;
 };
 
-template <typename T> 
-class encoder;
+// Returns the number of bytes in the varint encoding of the value.
+constexpr std::size_t varint_size(std::uint64_t value) noexcept {
+  return (std::bit_width(value | 1) + 6) / 7;
+}
+
+// An encoder<T> describes how to encode a T, with two static functions:
+//
+//   static std::size_t size(const T&) noexcept;
+//   static void write(byte_writer&, const T&) noexcept;
+//
+// where write() writes exactly size() bytes. An encoder for a type whose
+// encoding always has the same size also has a `fixed_size` constant, which
+// lets containers of it be sized without visiting every element.
+template <typename T, typename = void>
+struct encoder;
+
+template <typename T>
+std::size_t encoded_size(const T& value) noexcept {
+  return encoder<T>::size(value);
+}
+
+// Append the encoding of the value to the buffer, which grows at most once.
+template <typename T>
+void encode(std::string& buffer, const T& value) {
+  const std::size_t offset = buffer.size();
+  buffer.resize(offset + encoded_size(value));
+  byte_writer writer(buffer.data() + offset);
+  encoder<T>::write(writer, value);
+}
+
+namespace detail {
+error encode_buffer_too_small(std::size_t needed,
+                              std::size_t available) noexcept;
+}  // namespace detail
 
-// Helper function for deducing types
+// Encode the value into the start of the output, returning the bytes that
+// were written. Nothing is written if the output is too small.
 template <typename T>
-void encode(std::ostream& target, const T& value) noexcept {
-  encoder<T>{target}(value);
+result<span<char>> encode(span<char> output, const T& value) noexcept {
+  const std::size_t size = encoded_size(value);
+  if (size > output.size()) {
+    return detail::encode_buffer_too_small(size, output.size());
+  }
+  byte_writer writer(output.data());
+  encoder<T>::write(writer, value);
+  return output.subspan(0, size);
 }
 
-// Decoders for concrete types
+namespace detail {
+
+template <typename T, typename = void>
+struct has_fixed_size : std::false_type {};
+
+template <typename T>
+struct has_fixed_size<T, std::void_t<decltype(encoder<T>::fixed_size)>>
+    : std::true_type {};
+
+// True if the encoding of a T is exactly its representation in memory, so
+// that encoded values can be viewed (or copied) in place. This holds for
+// arithmetic types other than bool on little-endian machines, and for arrays
+// of them.
+template <typename T>
+struct has_raw_encoding
+    : std::bool_constant<std::endian::native == std::endian::little &&
+                         ((std::is_integral_v<T> && !std::is_same_v<T, bool>) ||
+                          (std::is_floating_point_v<T> &&
+                           std::numeric_limits<T>::is_iec559 &&
+                           (sizeof(T) == 4 || sizeof(T) == 8)))> {};
+
+template <typename T, std::size_t n>
+struct has_raw_encoding<std::array<T, n>>
+    : std::bool_constant<has_raw_encoding<T>::value &&
+                         sizeof(std::array<T, n>) == n * sizeof(T)> {};
+
+// The total size of a sequence of values.
+template <typename T>
+std::size_t encoded_size(const T* values, std::size_t count) noexcept {
+  if constexpr (has_fixed_size<T>::value) {
+    return count * encoder<T>::fixed_size;
+  } else {
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < count; i++) size += encoder<T>::size(values[i]);
+    return size;
+  }
+}
+
+// Sequences of integers and floating point values (and arrays of them) are
+// written in bulk rather than one element at a time: with a single memcpy if
+// their encoding is the same as their representation in memory, or else by
+// swapping the bytes of every element in one pass.
+template <typename T>
+void write_sequence(byte_writer& writer, const T* values,
+                    std::size_t count) noexcept {
+  if constexpr (has_raw_encoding<T>::value) {
+    if (count != 0) writer.write(values, count * sizeof(T));
+  } else if constexpr (std::is_arithmetic_v<T> && !std::is_same_v<T, bool>) {
+    writer.write_little_endian(values, count);
+  } else {
+    for (std::size_t i = 0; i < count; i++) {
+      encoder<T>::write(writer, values[i]);
+    }
+  }
+}
+
+// Sequences with a length prefix.
+template <typename T>
+struct sized_sequence_encoder {
+  static std::size_t size(const T* values, std::size_t count) noexcept {
+    return varint_size(count) + encoded_size(values, count);
+  }
+  static void write(byte_writer& writer, const T* values,
+                    std::size_t count) noexcept {
+    writer.write_varint(count);
+    write_sequence(writer, values, count);
+  }
+};
+
+}  // namespace detail
+
+template <typename T>
+struct encoder<T, std::enable_if_t<std::is_integral_v<T>>> {
+  static constexpr std::size_t fixed_size = sizeof(T);
+  static constexpr std::size_t size(T) noexcept { return fixed_size; }
+  static void write(byte_writer& writer, T value) noexcept {
+    writer.write_little_endian(std::make_unsigned_t<T>(value));
+  }
+};
+
 template <>
-class encoder<unsigned int> : public encoder_base {
- public:
-  void operator()(const unsigned int& value) const noexcept;
+struct encoder<bool> {
+  static constexpr std::size_t fixed_size = 1;
+  static constexpr std::size_t size(bool) noexcept { return fixed_size; }
+  static void write(byte_writer& writer, bool value) noexcept {
+    writer.write_little_endian(std::uint8_t{value});
+  }
 };
 
-/*template <>
-class encoder<float> : public encoder_base {
- public:
-  void operator()(const float& value) const noexcept;
-};*/  
+template <typename T>
+struct encoder<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static_assert(std::numeric_limits<T>::is_iec559 &&
+                (sizeof(T) == 4 || sizeof(T) == 8));
+  using bits = std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>;
+  static constexpr std::size_t fixed_size = sizeof(T);
+  static constexpr std::size_t size(T) noexcept { return fixed_size; }
+  static void write(byte_writer& writer, T value) noexcept {
+    writer.write_little_endian(std::bit_cast<bits>(value));
+  }
+};
+
+template <typename T>
+struct encoder<varint<T>> {
+  static std::uint64_t zigzag(T value) noexcept {
+    if constexpr (std::is_signed_v<T>) {
+      const auto bits = (std::uint64_t)(std::int64_t)value;
+      return bits << 1 ^ (std::uint64_t)((std::int64_t)value >> 63);
+    } else {
+      return value;
+    }
+  }
+  static std::size_t size(varint<T> v) noexcept {
+    return varint_size(zigzag(v.value));
+  }
+  static void write(byte_writer& writer, varint<T> v) noexcept {
+    writer.write_varint(zigzag(v.value));
+  }
+};
 
 template <>
-class encoder<char> : public encoder_base {
- public:
-  void operator()(const char& value) const noexcept;
+struct encoder<std::string_view> {
+  static std::size_t size(std::string_view value) noexcept {
+    return varint_size(value.size()) + value.size();
+  }
+  static void write(byte_writer& writer, std::string_view value) noexcept {
+    writer.write_varint(value.size());
+    writer.write(value.data(), value.size());
+  }
 };
 
+template <>
+struct encoder<std::string> : encoder<std::string_view> {};
+
 template <typename T>
-class encoder<std::vector<T>> : public encoder_base {
+struct encoder<std::vector<T>> {
+  static std::size_t size(const std::vector<T>& value) noexcept {
+    return detail::sized_sequence_encoder<T>::size(value.data(), value.size());
+  }
+  static void write(byte_writer& writer,
+                    const std::vector<T>& value) noexcept {
+    detail::sized_sequence_encoder<T>::write(writer, value.data(),
+                                             value.size());
+  }
+};
+
+template <typename T>
+struct encoder<span<T>> {
+  using element = std::remove_const_t<T>;
+  static std::size_t size(span<T> value) noexcept {
+    return detail::sized_sequence_encoder<element>::size(value.data(),
+                                                         value.size());
+  }
+  static void write(byte_writer& writer, span<T> value) noexcept {
+    detail::sized_sequence_encoder<element>::write(writer, value.data(),
+                                                   value.size());
+  }
+};
+
+namespace detail {
+
+// An array of fixed size elements has a fixed size itself.
+template <typename T, std::size_t n, bool = has_fixed_size<T>::value>
+struct array_fixed_size {};
+
+template <typename T, std::size_t n>
+struct array_fixed_size<T, n, true> {
+  static constexpr std::size_t fixed_size = n * encoder<T>::fixed_size;
+};
+
+}  // namespace detail
+
+// Arrays have a length which is known at compile time, so it is not encoded.
+template <typename T, std::size_t n>
+struct encoder<std::array<T, n>> : detail::array_fixed_size<T, n> {
+  static std::size_t size(const std::array<T, n>& value) noexcept {
+    return detail::encoded_size(value.data(), n);
+  }
+  static void write(byte_writer& writer,
+                    const std::array<T, n>& value) noexcept {
+    detail::write_sequence(writer, value.data(), n);
+  }
+};
+
+// Reads the input of decoders. Reads of a fixed size are unchecked, and may
+// only be used once the caller has checked that there is enough input
+// remaining. A decoder which finds a problem with its input records it with
+// fail(), so that nested decoders can report failure with a plain bool, and
+// only the outermost decode() produces a status.
+class byte_reader {
  public:
-  void operator()(const std::vector<T>& value) const noexcept {
-    unsigned int size = value.size();
-    encode(*out_stream_, size);
-    for (unsigned int i = 0; i < size; ++i) {
-      encode(*out_stream_, value[i]);
+  explicit byte_reader(span<const char> input) noexcept
+      : position_(input.data()), end_(input.data() + input.size()) {}
+
+  const char* position() const noexcept { return position_; }
+  std::size_t remaining() const noexcept { return end_ - position_; }
+
+  span<const char> take(std::size_t size) noexcept {
+    assert(size <= remaining());
+    const span<const char> bytes(position_, size);
+    position_ += size;
+    return bytes;
+  }
+
+  // Read an unsigned integer in little-endian byte order.
+  template <typename T>
+  T read_little_endian() noexcept {
+    static_assert(std::is_unsigned_v<T>);
+    assert(sizeof(T) <= remaining());
+    T value;
+    if constexpr (std::endian::native == std::endian::little) {
+      std::memcpy(&value, position_, sizeof(T));
+      position_ += sizeof(T);
+    } else {
+      value = 0;
+      for (std::size_t i = 0; i < sizeof(T); i++) {
+        value |= T((unsigned char)*position_++) << (8 * i);
+      }
+    }
+    return value;
+  }
+
+  // Read a varint. Its length is not known in advance, so this is checked.
+  bool read_varint(std::uint64_t& value) noexcept {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (position_ == end_) return fail("input is truncated");
+      const auto byte = (unsigned char)*position_++;
+      // The tenth byte only has room for the top bit of a 64 bit value.
+      if (shift == 63 && byte > 1) break;
+      value |= std::uint64_t{byte & 0x7fu} << shift;
+      if (byte < 0x80) return true;
     }
-  };
+    return fail("varint is too large");
+  }
+
+  // Record why the input could not be decoded, and return false.
+  bool fail(const char* message) noexcept {
+    error_ = message;
+    return false;
+  }
+  bool truncated() noexcept { return fail("input is truncated"); }
+  const char* error() const noexcept { return error_; }
+
+ private:
+  const char* position_;
+  const char* end_;
+  const char* error_ = nullptr;
 };
 
-}  // namespace util
+// A decoder<T> describes how to decode a T, with a static function:
+//
+//   static bool read(byte_reader&, T&) noexcept;
+//
+// which returns false (after calling byte_reader::fail()) if the input is
+// truncated or is not a valid encoding of a T. A decoder for a type whose
+// encoding always has the same size, and which cannot be invalid, also has a
+// `fixed_size` constant and
+//
+//   static T read_unchecked(byte_reader&) noexcept;
+//
+// which may only be used once the caller has checked that fixed_size bytes
+// remain. This lets a sequence of them be read with a single check.
+//
+// Decoders for std::string_view and span<const T> produce views of the input
+// instead of copies, so the input must outlive the decoded value.
+template <typename T, typename = void>
+struct decoder;
+
+namespace detail {
+error decode_error(const char* message) noexcept;
+}  // namespace detail
+
+// Decode a value from the start of the reader's input, leaving the reader at
+// the end of it.
+template <typename T>
+result<T> decode(byte_reader& reader) noexcept {
+  T value{};
+  if (!decoder<T>::read(reader, value)) {
+    return detail::decode_error(reader.error());
+  }
+  return value;
+}
+
+// Decode a value which takes up the whole of the input.
+template <typename T>
+result<T> decode(span<const char> input) noexcept {
+  byte_reader reader(input);
+  T value{};
+  if (!decoder<T>::read(reader, value)) {
+    return detail::decode_error(reader.error());
+  }
+  if (reader.remaining() != 0) {
+    return detail::decode_error("unexpected bytes after the end of the value");
+  }
+  return value;
+}
+
+namespace detail {
+
+template <typename T, typename = void>
+struct has_unchecked_read : std::false_type {};
+
+template <typename T>
+struct has_unchecked_read<
+    T, std::void_t<decltype(decoder<T>::fixed_size),
+                   decltype(decoder<T>::read_unchecked)>> : std::true_type {};
+
+// The read() function for a decoder with an unchecked read.
+template <typename T>
+bool read_fixed(byte_reader& reader, T& value) noexcept {
+  if (reader.remaining() < decoder<T>::fixed_size) return reader.truncated();
+  value = decoder<T>::read_unchecked(reader);
+  return true;
+}
+
+// Read the length of a sequence, checking that the input could hold that many
+// elements of at least the given size each. This keeps a corrupt length from
+// causing a huge allocation.
+inline bool read_length(byte_reader& reader, std::size_t element_size,
+                        std::size_t& length) noexcept {
+  std::uint64_t value;
+  if (!reader.read_varint(value)) return false;
+  if (element_size != 0 && value > reader.remaining() / element_size) {
+    return reader.truncated();
+  }
+  length = (std::size_t)value;
+  return true;
+}
+
+// Read elements into memory which has already been allocated for them.
+template <typename T>
+bool read_sequence(byte_reader& reader, T* values,
+                   std::size_t count) noexcept {
+  if constexpr (has_raw_encoding<T>::value) {
+    if (count > reader.remaining() / sizeof(T)) return reader.truncated();
+    // An empty vector may have a null data pointer, which memcpy disallows.
+    if (count == 0) return true;
+    std::memcpy(values, reader.take(count * sizeof(T)).data(),
+                count * sizeof(T));
+  } else if constexpr (has_unchecked_read<T>::value) {
+    // Elements of size zero (empty arrays) need no input at all.
+    if constexpr (decoder<T>::fixed_size != 0) {
+      if (count > reader.remaining() / decoder<T>::fixed_size) {
+        return reader.truncated();
+      }
+    }
+    for (std::size_t i = 0; i < count; i++) {
+      values[i] = decoder<T>::read_unchecked(reader);
+    }
+  } else {
+    for (std::size_t i = 0; i < count; i++) {
+      if (!decoder<T>::read(reader, values[i])) return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace detail
+
+template <typename T>
+struct decoder<T, std::enable_if_t<std::is_integral_v<T>>> {
+  static constexpr std::size_t fixed_size = sizeof(T);
+  static T read_unchecked(byte_reader& reader) noexcept {
+    return T(reader.read_little_endian<std::make_unsigned_t<T>>());
+  }
+  static bool read(byte_reader& reader, T& value) noexcept {
+    return detail::read_fixed(reader, value);
+  }
+};
+
+// Only 0 and 1 are valid, so a bool cannot be read unchecked.
+template <>
+struct decoder<bool> {
+  static bool read(byte_reader& reader, bool& value) noexcept {
+    if (reader.remaining() < 1) return reader.truncated();
+    const auto byte = reader.read_little_endian<std::uint8_t>();
+    if (byte > 1) return reader.fail("invalid bool");
+    value = byte == 1;
+    return true;
+  }
+};
+
+template <typename T>
+struct decoder<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  using bits = typename encoder<T>::bits;
+  static constexpr std::size_t fixed_size = sizeof(T);
+  static T read_unchecked(byte_reader& reader) noexcept {
+    return std::bit_cast<T>(reader.read_little_endian<bits>());
+  }
+  static bool read(byte_reader& reader, T& value) noexcept {
+    return detail::read_fixed(reader, value);
+  }
+};
+
+template <typename T>
+struct decoder<varint<T>> {
+  static bool read(byte_reader& reader, varint<T>& value) noexcept {
+    std::uint64_t bits;
+    if (!reader.read_varint(bits)) return false;
+    using limits = std::numeric_limits<T>;
+    if constexpr (std::is_signed_v<T>) {
+      const auto decoded = (std::int64_t)(bits >> 1 ^ (0 - (bits & 1)));
+      if (decoded < limits::min() || decoded > limits::max()) {
+        return reader.fail("varint is out of range");
+      }
+      value.value = T(decoded);
+    } else {
+      if (bits > limits::max()) return reader.fail("varint is out of range");
+      value.value = T(bits);
+    }
+    return true;
+  }
+};
+
+template <>
+struct decoder<std::string_view> {
+  static bool read(byte_reader& reader, std::string_view& value) noexcept {
+    std::size_t size;
+    if (!detail::read_length(reader, 1, size)) return false;
+    const span<const char> bytes = reader.take(size);
+    value = std::string_view(bytes.data(), bytes.size());
+    return true;
+  }
+};
+
+template <>
+struct decoder<std::string> {
+  static bool read(byte_reader& reader, std::string& value) noexcept {
+    std::string_view view;
+    if (!decoder<std::string_view>::read(reader, view)) return false;
+    value.assign(view);
+    return true;
+  }
+};
 
+template <typename T>
+struct decoder<std::vector<T>> {
+  static bool read(byte_reader& reader, std::vector<T>& value) noexcept {
+    // Every element takes up at least one byte, except in the unlikely case of
+    // an empty array. A vector of those is limited in the same way, since
+    // otherwise nothing would bound the size of the allocation.
+    std::size_t min_size = 1;
+    if constexpr (detail::has_unchecked_read<T>::value) {
+      min_size = std::max<std::size_t>(decoder<T>::fixed_size, 1);
+    }
+    std::size_t size;
+    if (!detail::read_length(reader, min_size, size)) return false;
+    value.resize(size);
+    return detail::read_sequence(reader, value.data(), size);
+  }
+};
+
+// A span is decoded as a view of the input, which is only possible for
+// elements whose encoding is the same as their representation in memory. The
+// encoding does not pad anything to keep it aligned, so this fails if the
+// elements are not suitably aligned in the input; a std::vector can be used
+// to decode a copy instead.
+template <typename T>
+struct decoder<span<const T>> {
+  static_assert(detail::has_raw_encoding<T>::value,
+                "elements must be encoded as they are laid out in memory");
+  static bool read(byte_reader& reader, span<const T>& value) noexcept {
+    std::size_t size;
+    if (!detail::read_length(reader, sizeof(T), size)) return false;
+    // An empty span does not point at anything, so it can be misaligned.
+    if (size == 0) {
+      value = span<const T>();
+      return true;
+    }
+    const span<const char> bytes = reader.take(size * sizeof(T));
+    if ((std::uintptr_t)bytes.data() % alignof(T) != 0) {
+      return reader.fail("span elements are not aligned");
+    }
+    value = span<const T>(reinterpret_cast<const T*>(bytes.data()), size);
+    return true;
+  }
+};
+
+namespace detail {
+
+template <typename T, std::size_t n, bool = has_unchecked_read<T>::value>
+struct array_decoder {
+  static bool read(byte_reader& reader, std::array<T, n>& value) noexcept {
+    return read_sequence(reader, value.data(), n);
+  }
+};
+
+// An array of elements with unchecked reads can be read unchecked itself.
+template <typename T, std::size_t n>
+struct array_decoder<T, n, true> {
+  static constexpr std::size_t fixed_size = n * decoder<T>::fixed_size;
+  static std::array<T, n> read_unchecked(byte_reader& reader) noexcept {
+    std::array<T, n> value;
+    for (T& element : value) element = decoder<T>::read_unchecked(reader);
+    return value;
+  }
+  static bool read(byte_reader& reader, std::array<T, n>& value) noexcept {
+    return read_fixed(reader, value);
+  }
+};
+
+}  // namespace detail
+
+template <typename T, std::size_t n>
+struct decoder<std::array<T, n>> : detail::array_decoder<T, n> {};
+
+}  // namespace util
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
 namespace util {
 namespace detail {
 
@@ -71,8 +77,8 @@ class span {
   constexpr T* end() const noexcept { return data_ + size_; }
 
  private:
-  T* data_;
-  std::size_t size_;
+  T* data_ = nullptr;
+  std::size_t size_ = 0;
 };
 
 }  // namespace util
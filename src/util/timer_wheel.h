@@ -0,0 +1,290 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace util {
+
+// Identifies a timer in a timer_wheel. An id remains safe to use after the
+// timer has expired or been cancelled: it simply stops referring to anything.
+struct timer_id {
+  std::uint32_t index;
+  std::uint32_t generation;
+};
+
+// A hierarchical timing wheel, holding values of type T until a deadline.
+// Adding and cancelling a timer are both O(1). Time is measured in ticks of a
+// fixed resolution, and a timer expires at the first tick boundary at or after
+// its deadline. Expired timers are moved to a FIFO queue, from which they can
+// be popped in the order in which they expired.
+//
+// The wheel has a number of levels, each of which has 64 slots. A slot at level
+// L covers 64^L ticks. A timer is placed at the level of the most significant
+// base-64 digit in which its deadline differs from the current time, so that
+// every occupied slot is strictly in the future. When the wheel advances to the
+// start of a slot, the timers in that slot are redistributed to lower levels
+// (or to the expired queue if they are due).
+template <typename T>
+class timer_wheel {
+ public:
+  using clock = std::chrono::steady_clock;
+  using time_point = clock::time_point;
+  using duration = clock::duration;
+
+  static constexpr duration resolution = std::chrono::milliseconds(1);
+
+  explicit timer_wheel(time_point start = clock::now()) noexcept
+      : start_(start), now_time_(start) {
+    const auto range = (time_point::max() - start) / resolution;
+    max_ticks_ = range < 0 ? 0 : (std::uint64_t)range;
+  }
+
+  // Not copyable.
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  // Movable.
+  timer_wheel(timer_wheel&&) noexcept = default;
+  timer_wheel& operator=(timer_wheel&&) noexcept = default;
+
+  // Returns the total number of timers in the wheel, including expired timers
+  // which have not been popped yet.
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  // Returns the number of expired timers waiting to be popped.
+  std::size_t num_expired() const noexcept { return num_expired_; }
+
+  // Add a value which expires at the given time. Times which are not after the
+  // most recent call to advance() expire immediately.
+  timer_id add(time_point time, T value) noexcept {
+    const std::uint32_t index = allocate(std::move(value));
+    nodes_[index].deadline = time <= now_time_ ? now_ : to_ticks(time);
+    insert(index);
+    return timer_id{index, nodes_[index].generation};
+  }
+
+  // Add a value to the end of the expired queue.
+  timer_id push(T value) noexcept {
+    const std::uint32_t index = allocate(std::move(value));
+    nodes_[index].deadline = now_;
+    append(expired_list, index);
+    num_expired_++;
+    return timer_id{index, nodes_[index].generation};
+  }
+
+  // Remove a timer from the wheel, whether or not it has expired yet. Returns
+  // false if the timer has already been popped or cancelled.
+  bool cancel(timer_id id) noexcept {
+    if (id.index >= nodes_.size()) return false;
+    node& n = nodes_[id.index];
+    if (n.list == free_list || n.generation != id.generation) return false;
+    if (n.list == expired_list) num_expired_--;
+    unlink(id.index);
+    release(id.index);
+    return true;
+  }
+
+  // Advance the wheel to the given time, expiring any timers that are due.
+  // Moving backwards in time has no effect.
+  void advance(time_point time) noexcept {
+    if (time <= now_time_) return;
+    now_time_ = time;
+    const std::uint64_t target = to_ticks(time, /*round_up=*/false);
+    while (true) {
+      const std::optional<slot_ref> next = next_slot();
+      if (!next || next->deadline > target) break;
+      now_ = next->deadline;
+      // Redistribute every timer in the slot. Each one will end up either at a
+      // lower level or in the expired queue.
+      list& l = slots_[next->level][next->slot];
+      std::uint32_t i = l.head;
+      l = list{};
+      occupied_[next->level] &= ~(std::uint64_t{1} << next->slot);
+      while (i != npos) {
+        const std::uint32_t following = nodes_[i].next;
+        insert(i);
+        i = following;
+      }
+    }
+    now_ = target;
+  }
+
+  // Remove the oldest expired timer and return its value. Requires
+  // num_expired() > 0.
+  T pop() noexcept {
+    assert(num_expired_ > 0);
+    const std::uint32_t index = expired_.head;
+    T value = std::move(nodes_[index].value);
+    num_expired_--;
+    unlink(index);
+    release(index);
+    return value;
+  }
+
+  // Returns the earliest time at which advance() might expire another timer,
+  // or nothing if there are no pending timers. If there are already expired
+  // timers, this is the time of the most recent advance().
+  std::optional<time_point> next_expiry() const noexcept {
+    if (num_expired_ > 0) return now_time_;
+    const std::optional<slot_ref> next = next_slot();
+    if (!next) return std::nullopt;
+    if (next->deadline >= max_ticks_) return time_point::max();
+    return start_ + next->deadline * resolution;
+  }
+
+ private:
+  static constexpr int bits_per_level = 6;
+  static constexpr int slots_per_level = 1 << bits_per_level;
+  // Enough levels to place any 64-bit deadline.
+  static constexpr int num_levels = (64 + bits_per_level - 1) / bits_per_level;
+  static constexpr std::uint32_t npos = -1;
+  static constexpr std::uint16_t expired_list = num_levels * slots_per_level;
+  static constexpr std::uint16_t free_list = expired_list + 1;
+
+  struct node {
+    T value;
+    std::uint64_t deadline = 0;
+    std::uint32_t previous = npos;
+    std::uint32_t next = npos;
+    std::uint32_t generation = 0;
+    std::uint16_t list = free_list;
+  };
+
+  struct list {
+    std::uint32_t head = npos;
+    std::uint32_t tail = npos;
+  };
+
+  struct slot_ref {
+    int level;
+    int slot;
+    std::uint64_t deadline;
+  };
+
+  // Convert a time into ticks since the start of the wheel.
+  std::uint64_t to_ticks(time_point time, bool round_up = true) const noexcept {
+    if (time <= start_) return 0;
+    const duration offset = time - start_;
+    std::uint64_t ticks = offset / resolution;
+    if (round_up && offset % resolution != duration::zero()) ticks++;
+    return std::min(ticks, max_ticks_);
+  }
+
+  // Find the earliest occupied slot in the wheel. Lower levels always expire
+  // before higher levels, so this is the first occupied slot after the current
+  // time in the lowest non-empty level.
+  std::optional<slot_ref> next_slot() const noexcept {
+    for (int level = 0; level < num_levels; level++) {
+      const int shift = level * bits_per_level;
+      const int digit = (now_ >> shift) % slots_per_level;
+      const std::uint64_t later =
+          digit + 1 == slots_per_level ? 0 : ~std::uint64_t{0} << (digit + 1);
+      const std::uint64_t candidates = occupied_[level] & later;
+      if (candidates == 0) continue;
+      const int slot = __builtin_ctzll(candidates);
+      const int level_shift = shift + bits_per_level;
+      const std::uint64_t prefix =
+          level_shift >= 64 ? 0 : now_ >> level_shift << level_shift;
+      return slot_ref{level, slot, prefix | (std::uint64_t)slot << shift};
+    }
+    return std::nullopt;
+  }
+
+  // Place an unlinked node in the correct list for its deadline.
+  void insert(std::uint32_t index) noexcept {
+    const std::uint64_t deadline = nodes_[index].deadline;
+    if (deadline <= now_) {
+      append(expired_list, index);
+      num_expired_++;
+      return;
+    }
+    const int level =
+        (63 - __builtin_clzll(deadline ^ now_)) / bits_per_level;
+    const int slot = (deadline >> (level * bits_per_level)) % slots_per_level;
+    append(level * slots_per_level + slot, index);
+    occupied_[level] |= std::uint64_t{1} << slot;
+  }
+
+  list& get_list(std::uint16_t id) noexcept {
+    if (id == expired_list) return expired_;
+    return slots_[id / slots_per_level][id % slots_per_level];
+  }
+
+  void append(std::uint16_t id, std::uint32_t index) noexcept {
+    list& l = get_list(id);
+    node& n = nodes_[index];
+    n.list = id;
+    n.previous = l.tail;
+    n.next = npos;
+    if (l.tail == npos) {
+      l.head = index;
+    } else {
+      nodes_[l.tail].next = index;
+    }
+    l.tail = index;
+  }
+
+  void unlink(std::uint32_t index) noexcept {
+    node& n = nodes_[index];
+    list& l = get_list(n.list);
+    if (n.previous == npos) {
+      l.head = n.next;
+    } else {
+      nodes_[n.previous].next = n.next;
+    }
+    if (n.next == npos) {
+      l.tail = n.previous;
+    } else {
+      nodes_[n.next].previous = n.previous;
+    }
+    if (l.head == npos && n.list != expired_list) {
+      const int level = n.list / slots_per_level;
+      const int slot = n.list % slots_per_level;
+      occupied_[level] &= ~(std::uint64_t{1} << slot);
+    }
+  }
+
+  std::uint32_t allocate(T value) noexcept {
+    std::uint32_t index;
+    if (free_ == npos) {
+      index = nodes_.size();
+      nodes_.emplace_back();
+    } else {
+      index = free_;
+      free_ = nodes_[index].next;
+    }
+    nodes_[index].value = std::move(value);
+    size_++;
+    return index;
+  }
+
+  void release(std::uint32_t index) noexcept {
+    node& n = nodes_[index];
+    n.value = T{};
+    n.generation++;
+    n.list = free_list;
+    n.next = free_;
+    free_ = index;
+    size_--;
+  }
+
+  time_point start_;
+  // The time of the most recent advance(), and the same time in ticks.
+  time_point now_time_;
+  std::uint64_t now_ = 0;
+  std::uint64_t max_ticks_;
+  std::vector<node> nodes_;
+  std::uint32_t free_ = npos;
+  std::size_t size_ = 0;
+  std::size_t num_expired_ = 0;
+  list expired_;
+  std::array<std::uint64_t, num_levels> occupied_ = {};
+  std::array<std::array<list, slots_per_level>, num_levels> slots_;
+};
+
+}  // namespace util
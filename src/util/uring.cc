@@ -0,0 +1,185 @@
+#include "uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+namespace util {
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* params) noexcept {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, const void* arg, std::size_t size) noexcept {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+                 size);
+}
+
+template <typename T>
+T* offset(void* base, unsigned offset) noexcept {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+}  // namespace
+
+result<uring> uring::create(unsigned entries) noexcept {
+  uring ring;
+  if (status s = ring.init(entries); s.failure()) return error{std::move(s)};
+  return ring;
+}
+
+uring::uring() noexcept {}
+
+status uring::init(unsigned entries) noexcept {
+  reset();
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  const int fd = io_uring_setup(entries, &params);
+  if (fd == -1) return status(std::errc{errno}, "from io_uring_setup");
+  fd_ = fd;
+  // Timeouts are passed directly to io_uring_enter(), and completions must
+  // never be dropped when the completion queue is full.
+  const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                            IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    reset();
+    return not_available("io_uring is missing required features");
+  }
+  // With IORING_FEAT_SINGLE_MMAP, both rings share a single mapping.
+  ring_size_ = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(unsigned),
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  void* ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    const int code = errno;
+    reset();
+    return status(std::errc{code}, "from mmap in uring::init()");
+  }
+  ring_ = ring;
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    const int code = errno;
+    reset();
+    return status(std::errc{code}, "from mmap in uring::init()");
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+  sq_head_ = offset<unsigned>(ring_, params.sq_off.head);
+  sq_tail_ = offset<unsigned>(ring_, params.sq_off.tail);
+  sq_array_ = offset<unsigned>(ring_, params.sq_off.array);
+  sq_mask_ = *offset<unsigned>(ring_, params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = offset<unsigned>(ring_, params.cq_off.head);
+  cq_tail_ = offset<unsigned>(ring_, params.cq_off.tail);
+  cqes_ = offset<void>(ring_, params.cq_off.cqes);
+  cq_mask_ = *offset<unsigned>(ring_, params.cq_off.ring_mask);
+  return status_code::ok;
+}
+
+uring::~uring() noexcept { reset(); }
+
+uring::uring(uring&& other) noexcept { *this = std::move(other); }
+
+uring& uring::operator=(uring&& other) noexcept {
+  if (this == &other) return *this;
+  reset();
+  fd_ = std::exchange(other.fd_, -1);
+  ring_ = std::exchange(other.ring_, nullptr);
+  ring_size_ = std::exchange(other.ring_size_, 0);
+  sqes_ = std::exchange(other.sqes_, nullptr);
+  sqes_size_ = std::exchange(other.sqes_size_, 0);
+  sq_head_ = std::exchange(other.sq_head_, nullptr);
+  sq_tail_ = std::exchange(other.sq_tail_, nullptr);
+  sq_array_ = std::exchange(other.sq_array_, nullptr);
+  sq_mask_ = std::exchange(other.sq_mask_, 0);
+  sq_entries_ = std::exchange(other.sq_entries_, 0);
+  cq_head_ = std::exchange(other.cq_head_, nullptr);
+  cq_tail_ = std::exchange(other.cq_tail_, nullptr);
+  cqes_ = std::exchange(other.cqes_, nullptr);
+  cq_mask_ = std::exchange(other.cq_mask_, 0);
+  pending_ = std::exchange(other.pending_, 0);
+  return *this;
+}
+
+uring::operator bool() const noexcept { return fd_ != -1; }
+
+io_uring_sqe* uring::get_sqe() noexcept {
+  const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  const unsigned tail = *sq_tail_ + pending_;
+  if (tail - head >= sq_entries_) return nullptr;
+  const unsigned index = tail & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  pending_++;
+  return sqe;
+}
+
+status uring::enter(bool wait, int timeout_ms) noexcept {
+  // Publish the new entries to the kernel. The kernel may not have consumed
+  // all of the entries from the previous call, so everything between the head
+  // and the tail is submitted, not only the new entries.
+  const unsigned tail = *sq_tail_ + pending_;
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  pending_ = 0;
+  const unsigned to_submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && !wait) return status_code::ok;
+  timespec timeout;
+  io_uring_getevents_arg arg;
+  std::memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (wait && timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1'000'000L;
+    arg.ts = reinterpret_cast<std::uint64_t>(&timeout);
+  }
+  const unsigned flags =
+      IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+  const int result =
+      io_uring_enter(fd_, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+  if (result >= 0) return status_code::ok;
+  // A timeout or a signal is not an error, it just means that there may be no
+  // completions available yet. EBUSY means that the completion queue is full
+  // and the caller needs to consume completions before submitting more, and
+  // EAGAIN means that the kernel is short of memory. Either way, the entries
+  // which were not submitted are retried by the next call.
+  if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) {
+    return status_code::ok;
+  }
+  return status(std::errc{errno}, "from io_uring_enter");
+}
+
+bool uring::pop(uring_completion& out) noexcept {
+  const unsigned head = *cq_head_;
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  if (head == tail) return false;
+  const io_uring_cqe& cqe =
+      static_cast<const io_uring_cqe*>(cqes_)[head & cq_mask_];
+  out = uring_completion{cqe.user_data, cqe.res, cqe.flags};
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void uring::reset() noexcept {
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (ring_) munmap(ring_, ring_size_);
+  if (fd_ != -1) ::close(fd_);
+  fd_ = -1;
+  ring_ = nullptr;
+  sqes_ = nullptr;
+  ring_size_ = sqes_size_ = 0;
+  pending_ = 0;
+}
+
+}  // namespace util
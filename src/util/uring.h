@@ -0,0 +1,84 @@
+#pragma once
+
+#include "result.h"
+#include "status.h"
+
+#include <cstdint>
+
+struct io_uring_sqe;
+
+namespace util {
+
+// A completed io_uring operation.
+struct uring_completion {
+  std::uint64_t user_data;
+  int result;
+  unsigned flags;
+};
+
+// A minimal wrapper around an io_uring instance, built directly on top of the
+// io_uring system calls. Submission queue entries are filled in by the caller
+// and are only passed to the kernel on the next call to enter(), so any number
+// of operations can be submitted with a single system call.
+class uring {
+ public:
+  // Equivalent to constructing a uring and calling init().
+  static result<uring> create(unsigned entries) noexcept;
+
+  // Construct an uninitialized uring.
+  uring() noexcept;
+  // Initialize the uring with space for the given number of submissions. This
+  // fails if io_uring is not supported by the kernel.
+  status init(unsigned entries) noexcept;
+
+  ~uring() noexcept;
+
+  // Not copyable.
+  uring(const uring&) = delete;
+  uring& operator=(const uring&) = delete;
+
+  // Movable.
+  uring(uring&& other) noexcept;
+  uring& operator=(uring&& other) noexcept;
+
+  explicit operator bool() const noexcept;
+
+  // Returns a zeroed submission queue entry, or nullptr if the queue is full.
+  // The entry is submitted by the next call to enter().
+  io_uring_sqe* get_sqe() noexcept;
+
+  // Submit all queued entries. If wait is true, also block until at least one
+  // completion is available or until the timeout expires. A negative timeout
+  // waits indefinitely.
+  status enter(bool wait, int timeout_ms) noexcept;
+
+  // Remove the next completion from the completion queue, if there is one.
+  bool pop(uring_completion& out) noexcept;
+
+ private:
+  void reset() noexcept;
+
+  int fd_ = -1;
+  // Memory mappings for the rings (which share a single mapping) and the
+  // submission queue entries.
+  void* ring_ = nullptr;
+  std::size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  // Pointers into the submission queue ring.
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  // Pointers into the completion queue ring.
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  void* cqes_ = nullptr;
+  unsigned cq_mask_ = 0;
+  // Submission queue entries which have been handed out by get_sqe() but not
+  // yet submitted.
+  unsigned pending_ = 0;
+};
+
+}  // namespace util
@@ -0,0 +1,731 @@
+#include "websocket.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTIL_WEBSOCKET_X86 1
+#endif
+
+namespace util {
+namespace {
+
+// The input buffer holds frame headers, control frames and whatever follows
+// them in each read. Message payloads are read straight into the receiver's
+// buffer instead, so this only needs to hold the largest frame header along
+// with the largest control frame, but a bigger buffer lets a burst of small
+// messages arrive with a single system call.
+constexpr std::size_t input_buffer_size = 4096;
+
+// Frame headers have a 2 byte prefix, an optional 2 or 8 byte extended length,
+// and (for frames sent by a client) a 4 byte masking key.
+constexpr std::size_t max_frame_header_size = 14;
+constexpr std::size_t max_control_payload = 125;
+
+constexpr bool is_control(websocket_opcode opcode) noexcept {
+  return (unsigned char)opcode & 0x8;
+}
+
+constexpr bool is_valid(websocket_opcode opcode) noexcept {
+  switch (opcode) {
+    case websocket_opcode::continuation:
+    case websocket_opcode::text:
+    case websocket_opcode::binary:
+    case websocket_opcode::close:
+    case websocket_opcode::ping:
+    case websocket_opcode::pong:
+      return true;
+  }
+  return false;
+}
+
+// Close codes which may appear in a close frame (RFC 6455 section 7.4 and the
+// IANA registry). Codes from 3000 up are for libraries and applications.
+constexpr bool is_valid_close_code(std::uint16_t code) noexcept {
+  return (1000 <= code && code <= 1003) || (1007 <= code && code <= 1014) ||
+         (3000 <= code && code <= 4999);
+}
+
+// A SHA-1 digest (FIPS 180-4), which the handshake needs for nothing more than
+// deriving the accept key, so this is written for clarity rather than speed.
+std::array<unsigned char, 20> sha1(std::string_view input) noexcept {
+  std::uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                        0xc3d2e1f0};
+  const auto rotl = [](std::uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+  };
+  const auto process = [&](const unsigned char* block) {
+    std::uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = std::uint32_t{block[4 * i]} << 24 |
+             std::uint32_t{block[4 * i + 1]} << 16 |
+             std::uint32_t{block[4 * i + 2]} << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      std::uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      const std::uint32_t t = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  };
+  const auto* data = reinterpret_cast<const unsigned char*>(input.data());
+  std::size_t size = input.size();
+  const std::uint64_t bit_length = std::uint64_t{size} * 8;
+  for (; size >= 64; data += 64, size -= 64) process(data);
+  // The final block (or two) holds the rest of the input, a 1 bit, padding and
+  // the length of the input in bits.
+  unsigned char tail[128] = {};
+  std::memcpy(tail, data, size);
+  tail[size] = 0x80;
+  const std::size_t tail_size = size + 9 <= 64 ? 64 : 128;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = (unsigned char)(bit_length >> (8 * i));
+  }
+  process(tail);
+  if (tail_size == 128) process(tail + 64);
+  std::array<unsigned char, 20> digest;
+  for (int i = 0; i < 20; i++) {
+    digest[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+  }
+  return digest;
+}
+
+std::string base64_encode(span<const unsigned char> input) noexcept {
+  static constexpr char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string output;
+  output.reserve((input.size() + 2) / 3 * 4);
+  for (std::size_t i = 0; i < input.size(); i += 3) {
+    const std::size_t n = std::min<std::size_t>(3, input.size() - i);
+    std::uint32_t group = std::uint32_t{input[i]} << 16;
+    if (n > 1) group |= std::uint32_t{input[i + 1]} << 8;
+    if (n > 2) group |= input[i + 2];
+    output += alphabet[group >> 18 & 0x3f];
+    output += alphabet[group >> 12 & 0x3f];
+    output += n > 1 ? alphabet[group >> 6 & 0x3f] : '=';
+    output += n > 2 ? alphabet[group & 0x3f] : '=';
+  }
+  return output;
+}
+
+// XOR the data with a 4 byte key which has already been rotated to line up
+// with the start of the data.
+using unmask_function = void (*)(char* data, std::size_t size,
+                                 const char* key) noexcept;
+
+// Masks eight bytes at a time with plain integer operations, which is already
+// much faster than going byte by byte.
+void unmask_scalar(char* data, std::size_t size, const char* key) noexcept {
+  char pattern[8];
+  std::memcpy(pattern, key, 4);
+  std::memcpy(pattern + 4, key, 4);
+  std::uint64_t wide_key;
+  std::memcpy(&wide_key, pattern, 8);
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    word ^= wide_key;
+    std::memcpy(data + i, &word, 8);
+  }
+  // The key repeats every 4 bytes, so it lines up again after each word.
+  for (; i < size; i++) data[i] ^= key[i % 4];
+}
+
+#ifdef UTIL_WEBSOCKET_X86
+__attribute__((target("sse2")))
+void unmask_sse2(char* data, std::size_t size, const char* key) noexcept {
+  std::int32_t key_bits;
+  std::memcpy(&key_bits, key, 4);
+  const __m128i wide_key = _mm_set1_epi32(key_bits);
+  std::size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    auto* block = reinterpret_cast<__m128i*>(data + i);
+    _mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), wide_key));
+  }
+  unmask_scalar(data + i, size - i, key);
+}
+
+__attribute__((target("avx2")))
+void unmask_avx2(char* data, std::size_t size, const char* key) noexcept {
+  std::int32_t key_bits;
+  std::memcpy(&key_bits, key, 4);
+  const __m256i wide_key = _mm256_set1_epi32(key_bits);
+  std::size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    auto* low = reinterpret_cast<__m256i*>(data + i);
+    auto* high = reinterpret_cast<__m256i*>(data + i + 32);
+    _mm256_storeu_si256(low,
+                        _mm256_xor_si256(_mm256_loadu_si256(low), wide_key));
+    _mm256_storeu_si256(high,
+                        _mm256_xor_si256(_mm256_loadu_si256(high), wide_key));
+  }
+  for (; i + 32 <= size; i += 32) {
+    auto* block = reinterpret_cast<__m256i*>(data + i);
+    _mm256_storeu_si256(block,
+                        _mm256_xor_si256(_mm256_loadu_si256(block), wide_key));
+  }
+  unmask_scalar(data + i, size - i, key);
+}
+#endif
+
+// Pick the best implementation which the CPU supports.
+unmask_function select_unmask() noexcept {
+#ifdef UTIL_WEBSOCKET_X86
+  // This runs during static initialization, so the CPU model has to be
+  // initialized explicitly before it is queried.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return unmask_avx2;
+  if (__builtin_cpu_supports("sse2")) return unmask_sse2;
+#endif
+  return unmask_scalar;
+}
+
+const unmask_function unmask = select_unmask();
+
+struct frame_header {
+  // The number of bytes in the header, which is zero if the input did not
+  // contain the whole header.
+  std::size_t size;
+  bool fin;
+  websocket_opcode opcode;
+  std::uint64_t length;
+  std::array<char, 4> mask;
+};
+
+error protocol_error(std::string message) noexcept {
+  return error{status(std::errc::protocol_error, std::move(message))};
+}
+
+// Parse a frame header sent by a client from the start of the input.
+result<frame_header> parse_frame_header(span<const char> input) noexcept {
+  frame_header header = {};
+  if (input.size() < 2) return header;
+  const auto byte = [&](std::size_t i) { return (unsigned char)input[i]; };
+  header.fin = byte(0) & 0x80;
+  header.opcode = websocket_opcode{(unsigned char)(byte(0) & 0x0f)};
+  // No extensions are negotiated, so the reserved bits must be clear.
+  if (byte(0) & 0x70) return protocol_error("reserved bits are set");
+  if (!is_valid(header.opcode)) return protocol_error("unknown opcode");
+  if (!(byte(1) & 0x80)) return protocol_error("client frame is not masked");
+  std::uint64_t length = byte(1) & 0x7f;
+  std::size_t size = 2;
+  if (length == 126) {
+    if (input.size() < 4) return header;
+    length = std::uint64_t{byte(2)} << 8 | byte(3);
+    size = 4;
+  } else if (length == 127) {
+    if (input.size() < 10) return header;
+    length = 0;
+    for (std::size_t i = 2; i < 10; i++) length = length << 8 | byte(i);
+    if (length >> 63) return protocol_error("frame length is too large");
+    size = 10;
+  }
+  if (is_control(header.opcode) &&
+      (!header.fin || length > max_control_payload)) {
+    return protocol_error("control frames cannot be fragmented or long");
+  }
+  if (input.size() < size + 4) return header;
+  std::memcpy(header.mask.data(), input.data() + size, 4);
+  header.length = length;
+  header.size = size + 4;
+  return header;
+}
+
+// Write the header of an unmasked frame, as sent by a server, returning its
+// size.
+std::size_t write_frame_header(char* output, websocket_opcode opcode, bool fin,
+                               std::uint64_t length) noexcept {
+  output[0] = (char)((fin ? 0x80 : 0) | (unsigned char)opcode);
+  if (length < 126) {
+    output[1] = (char)length;
+    return 2;
+  }
+  if (length <= 0xffff) {
+    output[1] = 126;
+    output[2] = (char)(length >> 8);
+    output[3] = (char)length;
+    return 4;
+  }
+  output[1] = 127;
+  for (int i = 0; i < 8; i++) output[2 + i] = (char)(length >> (56 - 8 * i));
+  return 10;
+}
+
+}  // namespace
+
+// The state of a websocket is kept at a fixed address, since operations on
+// the stream refer to it. Reading happens in a coroutine, with its frames
+// drawn from a pool so that receiving a message does not allocate. Writing is
+// driven by the completion of each write: frames which are waiting to be sent
+// are kept in slots (one for the user, and one each for the automatic pong
+// and close replies) and sent one at a time, control frames first.
+class websocket::state {
+ public:
+  state(tcp::stream stream, span<const char> buffered,
+        unique_function<void()> on_close,
+        executor::duration idle_timeout) noexcept
+      : stream(std::move(stream)),
+        on_close(std::move(on_close)),
+        idle_timeout(idle_timeout),
+        input(std::max(input_buffer_size, buffered.size())),
+        input_end(buffered.size()) {
+    std::memcpy(input.data(), buffered.data(), buffered.size());
+    // Messages are usually small and should go out as soon as they are sent.
+    // Failing to set this only costs latency, so it is not an error.
+    (void)this->stream.set_no_delay(true);
+  }
+
+  ~state() noexcept {
+    deadline.cancel();
+    if (on_close) on_close();
+  }
+
+  // Called when the websocket which owns the state is destroyed. The state
+  // stays alive until any frames that it still has to send have been sent,
+  // and until the continuation of a receive (which may well be what destroyed
+  // the websocket) has returned.
+  void orphan() noexcept {
+    orphaned = true;
+    if (!writing && receivers == 0) delete this;
+  }
+
+  static task<> receive(state& self, frame_pool&, span<char> buffer,
+                        unique_function<void(result<websocket_message>)> done) {
+    self.receivers++;
+    result<websocket_message> message =
+        co_await self.receive_message(self.frames, buffer);
+    done(std::move(message));
+    // The continuation may own the websocket, so it is destroyed here, while
+    // the state still counts this receiver, rather than with the frame.
+    done = nullptr;
+    // This frame belongs to the state's pool, so if the continuation orphaned
+    // the state, it can only be deleted once the frame has been released.
+    if (--self.receivers == 0 && self.orphaned && !self.writing) {
+      self.stream.context().schedule([&self] { delete &self; });
+    }
+  }
+
+  void send(websocket_opcode type, span<const char> data, bool fin,
+            unique_function<void(status)> done) noexcept {
+    assert(!frame_pending);
+    if (close_queued) {
+      done(error{status(std::errc::not_connected, "websocket is closed")});
+      return;
+    }
+    frame_pending = true;
+    frame_opcode = type;
+    frame_fin = fin;
+    frame_data = data;
+    frame_done = std::move(done);
+    pump();
+  }
+
+  void close(websocket_close_code code,
+             unique_function<void(status)> done) noexcept {
+    if (close_queued) {
+      done(error{status(std::errc::not_connected, "websocket is closed")});
+      return;
+    }
+    queue_close(code);
+    close_done = std::move(done);
+    pump();
+  }
+
+  tcp::stream stream;
+  frame_pool frames;
+
+ private:
+  // Receive frames until a message is complete, following RFC 6455 section
+  // 5. Text messages are not checked to be valid UTF-8.
+  task<result<websocket_message>> receive_message(frame_pool&,
+                                                  span<char> output) {
+    if (failed || close_received) {
+      co_return error{status(std::errc::not_connected, "websocket is closed")};
+    }
+    // The type of the message, once its first frame has arrived.
+    websocket_opcode type = websocket_opcode::continuation;
+    std::size_t size = 0;
+    while (true) {
+      result<frame_header> header = parse_frame_header(buffered());
+      if (header.failure()) {
+        co_return fail(websocket_close_code::protocol_error,
+                       std::move(header).status());
+      }
+      if (header->size == 0) {
+        if (status s = co_await read_more(frames); s.failure()) {
+          co_return fail_read(std::move(s));
+        }
+        continue;
+      }
+      input_begin += header->size;
+      if (is_control(header->opcode)) {
+        // Control frames are short, so they are always read into the input
+        // buffer. They may arrive between the fragments of a message.
+        while (buffered().size() < header->length) {
+          if (status s = co_await read_more(frames); s.failure()) {
+            co_return fail_read(std::move(s));
+          }
+        }
+        const span<char> payload(input.data() + input_begin, header->length);
+        input_begin += header->length;
+        websocket_unmask(payload, header->mask);
+        if (header->opcode == websocket_opcode::ping) {
+          // Only the most recent ping needs an answer.
+          std::memcpy(pong_payload.data(), payload.data(), payload.size());
+          pong_size = payload.size();
+          pong_pending = true;
+          pump();
+        } else if (header->opcode == websocket_opcode::close) {
+          co_return closed(payload, output);
+        }
+        continue;
+      }
+      if ((header->opcode == websocket_opcode::continuation) !=
+          (type != websocket_opcode::continuation)) {
+        co_return fail(websocket_close_code::protocol_error,
+                       protocol_error("fragments are out of order"));
+      }
+      if (type == websocket_opcode::continuation) type = header->opcode;
+      if (header->length > output.size() - size) {
+        co_return fail(websocket_close_code::message_too_big,
+                       status(std::errc::message_size,
+                              "websocket message does not fit in buffer"));
+      }
+      // Any of the payload which has already been read is copied out of the
+      // input buffer, and the rest is read directly into the output. Whatever
+      // follows the frame goes into the input buffer, in the same read.
+      const span<char> payload = output.subspan(size, header->length);
+      std::size_t received = std::min(payload.size(), buffered().size());
+      std::memcpy(payload.data(), input.data() + input_begin, received);
+      input_begin += received;
+      websocket_unmask(payload.subspan(0, received), header->mask);
+      while (received < payload.size()) {
+        input_begin = input_end = 0;
+        const span<char> parts[] = {payload.subspan(received), input};
+        set_deadline();
+        result<std::size_t> bytes =
+            co_await stream.read_some(span<const span<char>>(parts));
+        cancel_deadline();
+        if (bytes.failure()) co_return fail_read(std::move(bytes).status());
+        if (*bytes == 0) co_return fail(end_of_stream());
+        const std::size_t direct = std::min(*bytes, parts[0].size());
+        websocket_unmask(payload.subspan(received, direct), header->mask,
+                         received);
+        received += direct;
+        input_end = *bytes - direct;
+      }
+      size += payload.size();
+      if (header->fin) {
+        co_return websocket_message{type, output.subspan(0, size)};
+      }
+    }
+  }
+
+  // Handle a close frame from the peer, replying with a close frame of our own
+  // if we have not sent one already.
+  result<websocket_message> closed(span<const char> payload,
+                                   span<char> output) noexcept {
+    if (payload.size() == 1) {
+      return fail(websocket_close_code::protocol_error,
+                  protocol_error("truncated close code"));
+    }
+    auto code = websocket_close_code::no_status;
+    if (payload.size() >= 2) {
+      const std::uint16_t value = (std::uint16_t)(
+          (unsigned char)payload[0] << 8 | (unsigned char)payload[1]);
+      if (!is_valid_close_code(value)) {
+        return fail(websocket_close_code::protocol_error,
+                    protocol_error("invalid close code"));
+      }
+      code = websocket_close_code{value};
+      payload = payload.subspan(2);
+    }
+    close_received = true;
+    if (close_queued) {
+      shutdown_if_closed();
+    } else {
+      queue_close(code);
+      pump();
+    }
+    const std::size_t n = std::min(payload.size(), output.size());
+    std::memcpy(output.data(), payload.data(), n);
+    return websocket_message{websocket_opcode::close, output.subspan(0, n),
+                             code};
+  }
+
+  // Returns the input which has been read but not yet used.
+  span<const char> buffered() const noexcept {
+    return span<const char>(input.data() + input_begin,
+                            input_end - input_begin);
+  }
+
+  // Read more input into the input buffer, making space at the end first if
+  // necessary.
+  task<status> read_more(frame_pool&) {
+    if (input_end == input.size()) {
+      const std::size_t n = input_end - input_begin;
+      std::memmove(input.data(), input.data() + input_begin, n);
+      input_begin = 0;
+      input_end = n;
+    }
+    static_assert(input_buffer_size >=
+                  max_frame_header_size + max_control_payload);
+    set_deadline();
+    result<span<char>> bytes =
+        co_await stream.read_some(span<char>(input).subspan(input_end));
+    cancel_deadline();
+    if (bytes.failure()) co_return std::move(bytes).status();
+    if (bytes->empty()) co_return end_of_stream();
+    input_end += bytes->size();
+    co_return status_code::ok;
+  }
+
+  // Make the pending read fail with std::errc::timed_out if nothing arrives
+  // within the idle timeout.
+  void set_deadline() noexcept {
+    deadline = stream.context().schedule_in(
+        idle_timeout, [this] { stream.cancel_read(std::errc::timed_out); });
+  }
+
+  // Stop enforcing the deadline, including a cancellation which it made just
+  // as the read completed, which would otherwise apply to the next read.
+  void cancel_deadline() noexcept {
+    deadline.cancel();
+    stream.clear_cancel_read();
+  }
+
+  static error end_of_stream() noexcept {
+    return error{status(std::errc::connection_aborted,
+                        "websocket closed without a close frame")};
+  }
+
+  // Stop receiving because the stream failed.
+  error fail(status s) noexcept {
+    failed = true;
+    return error{std::move(s)};
+  }
+
+  // Stop receiving because a read failed. A peer which let a read time out may
+  // still be listening, so it is told why the connection is closing.
+  error fail_read(status s) noexcept {
+    // Statuses from different domains are compared by their canonical codes,
+    // so the domain has to be checked as well.
+    const status timeout = std::errc::timed_out;
+    if (s.domain() == timeout.domain() && s.code() == timeout.code()) {
+      return fail(websocket_close_code::going_away, std::move(s));
+    }
+    return fail(std::move(s));
+  }
+
+  // Stop receiving because the peer broke the protocol, and tell it why.
+  error fail(websocket_close_code code, status s) noexcept {
+    failed = true;
+    if (!close_queued) {
+      queue_close(code);
+      pump();
+    }
+    return error{std::move(s)};
+  }
+
+  void queue_close(websocket_close_code code) noexcept {
+    close_queued = true;
+    close_pending = true;
+    close_size = 0;
+    if (code != websocket_close_code::no_status) {
+      close_payload[0] = (char)((std::uint16_t)code >> 8);
+      close_payload[1] = (char)code;
+      close_size = 2;
+    }
+  }
+
+  // Once both sides have sent a close frame (or the peer can no longer be
+  // trusted to), the TCP connection is shut down.
+  void shutdown_if_closed() noexcept {
+    if (close_sent && (close_received || failed)) (void)stream.shutdown();
+  }
+
+  // Start sending the next frame, if nothing is being sent already.
+  void pump() noexcept {
+    if (writing) return;
+    if (pong_pending) {
+      pong_pending = false;
+      write_control(websocket_opcode::pong,
+                    span<const char>(pong_payload.data(), pong_size), nullptr);
+    } else if (frame_pending) {
+      frame_pending = false;
+      const std::size_t n = write_frame_header(
+          frame_prefix.data(), frame_opcode, frame_fin, frame_data.size());
+      output_buffers = {span<const char>(frame_prefix.data(), n), frame_data};
+      write(std::move(frame_done));
+    } else if (close_pending) {
+      close_pending = false;
+      writing_close = true;
+      write_control(websocket_opcode::close,
+                    span<const char>(close_payload.data(), close_size),
+                    std::move(close_done));
+    } else if (orphaned && receivers == 0) {
+      delete this;
+    }
+  }
+
+  // Control frames are copied into their own buffer, so that another one of
+  // the same kind can be queued while this one is being sent.
+  void write_control(websocket_opcode opcode, span<const char> payload,
+                     unique_function<void(status)> done) noexcept {
+    const std::size_t n =
+        write_frame_header(control_frame.data(), opcode, true, payload.size());
+    std::memcpy(control_frame.data() + n, payload.data(), payload.size());
+    output_buffers = {
+        span<const char>(control_frame.data(), n + payload.size()), {}};
+    write(std::move(done));
+  }
+
+  void write(unique_function<void(status)> done) noexcept {
+    writing = true;
+    write_done = std::move(done);
+    stream.write(span<const span<const char>>(output_buffers),
+                 [this](status s) { on_written(std::move(s)); });
+  }
+
+  void on_written(status s) noexcept {
+    writing = false;
+    if (std::exchange(writing_close, false)) {
+      close_sent = true;
+      shutdown_if_closed();
+    }
+    unique_function<void(status)> done = std::move(write_done);
+    // This may destroy the state, if it has been orphaned.
+    pump();
+    if (done) done(std::move(s));
+  }
+
+  unique_function<void()> on_close;
+  executor::duration idle_timeout;
+  executor::timer deadline;
+  bool orphaned = false;
+  int receivers = 0;
+  // Input which has been read from the stream but not yet used.
+  std::vector<char> input;
+  std::size_t input_begin = 0;
+  std::size_t input_end = 0;
+  bool failed = false;
+  bool close_received = false;
+  // The frame which is being sent, and the slots for those waiting to be sent.
+  bool writing = false;
+  bool writing_close = false;
+  std::array<span<const char>, 2> output_buffers;
+  unique_function<void(status)> write_done;
+  std::array<char, 4 + max_control_payload> control_frame;
+  bool frame_pending = false;
+  websocket_opcode frame_opcode = websocket_opcode::binary;
+  bool frame_fin = true;
+  span<const char> frame_data;
+  std::array<char, 10> frame_prefix;
+  unique_function<void(status)> frame_done;
+  bool pong_pending = false;
+  std::array<char, max_control_payload> pong_payload;
+  std::size_t pong_size = 0;
+  // A close frame is only ever sent once: close_queued is set as soon as one
+  // is due, and close_sent once it has been written.
+  bool close_queued = false;
+  bool close_pending = false;
+  bool close_sent = false;
+  std::array<char, 2> close_payload;
+  std::size_t close_size = 0;
+  unique_function<void(status)> close_done;
+};
+
+std::string websocket_accept_key(std::string_view key) noexcept {
+  // The accept key proves that the server understood the handshake: it is the
+  // hash of the client's key followed by a GUID from the RFC.
+  std::string input(key);
+  input += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  const std::array<unsigned char, 20> digest = sha1(input);
+  return base64_encode(digest);
+}
+
+void websocket_unmask(span<char> data, std::array<char, 4> key,
+                      std::uint64_t offset) noexcept {
+  const char rotated[4] = {key[offset % 4], key[(offset + 1) % 4],
+                           key[(offset + 2) % 4], key[(offset + 3) % 4]};
+  unmask(data.data(), data.size(), rotated);
+}
+
+websocket::websocket() noexcept = default;
+
+websocket::websocket(tcp::stream stream, span<const char> buffered,
+                     unique_function<void()> on_close,
+                     executor::duration idle_timeout) noexcept
+    : state_(std::make_unique<state>(std::move(stream), buffered,
+                                     std::move(on_close), idle_timeout)) {}
+
+websocket::~websocket() noexcept {
+  if (state_) state_.release()->orphan();
+}
+
+websocket::websocket(websocket&&) noexcept = default;
+
+websocket& websocket::operator=(websocket&& other) noexcept {
+  if (this == &other) return *this;
+  if (state_) state_.release()->orphan();
+  state_ = std::move(other.state_);
+  return *this;
+}
+
+void websocket::receive(
+    span<char> buffer,
+    unique_function<void(result<websocket_message>)> done) noexcept {
+  util::spawn(state::receive(*state_, state_->frames, buffer, std::move(done)));
+}
+
+void websocket::send(websocket_opcode type, span<const char> data,
+                     unique_function<void(status)> done) noexcept {
+  state_->send(type, data, true, std::move(done));
+}
+
+void websocket::send_fragment(websocket_opcode type, span<const char> data,
+                              bool final,
+                              unique_function<void(status)> done) noexcept {
+  state_->send(type, data, final, std::move(done));
+}
+
+void websocket::close(websocket_close_code code,
+                      unique_function<void(status)> done) noexcept {
+  state_->close(code, std::move(done));
+}
+
+websocket::operator bool() const noexcept { return (bool)state_; }
+
+io_context& websocket::context() const noexcept {
+  return state_->stream.context();
+}
+
+}  // namespace util
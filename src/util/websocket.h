@@ -0,0 +1,168 @@
+#pragma once
+
+#include "coroutine.h"
+#include "executor.h"
+#include "function.h"
+#include "net.h"
+#include "result.h"
+#include "span.h"
+#include "status.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace util {
+
+// The opcode of a websocket frame (RFC 6455 section 5.2).
+enum class websocket_opcode : unsigned char {
+  continuation = 0x0,
+  text = 0x1,
+  binary = 0x2,
+  close = 0x8,
+  ping = 0x9,
+  pong = 0xa,
+};
+
+// The status codes which are sent in a close frame (RFC 6455 section 7.4.1).
+enum class websocket_close_code : std::uint16_t {
+  normal = 1000,
+  going_away = 1001,
+  protocol_error = 1002,
+  unsupported_data = 1003,
+  // Never sent: reported when a close frame does not contain a code.
+  no_status = 1005,
+  invalid_payload = 1007,
+  policy_violation = 1008,
+  message_too_big = 1009,
+  internal_error = 1011,
+};
+
+// A complete message, received by websocket::receive().
+struct websocket_message {
+  // Either text, binary or close. A close message means that the peer has
+  // closed the connection, and no more messages will arrive.
+  websocket_opcode type;
+  // The payload of the message, in the buffer that was passed to receive().
+  // For a close message, this is the reason given by the peer, which is
+  // truncated if it does not fit in the buffer.
+  span<char> data;
+  // For a close message, the status code sent by the peer.
+  websocket_close_code close_code = websocket_close_code::no_status;
+};
+
+// Returns the Sec-WebSocket-Accept value which answers a handshake with the
+// given Sec-WebSocket-Key.
+std::string websocket_accept_key(std::string_view key) noexcept;
+
+// Apply a websocket masking key to part of a payload, starting the given
+// number of bytes into the payload. Masking is its own inverse, so this both
+// masks and unmasks. This uses SIMD instructions where the CPU supports them.
+void websocket_unmask(span<char> data, std::array<char, 4> key,
+                      std::uint64_t offset = 0) noexcept;
+
+// The server side of a websocket connection (RFC 6455), which exchanges
+// framed messages over a TCP stream once the opening handshake is complete.
+// Typically a websocket is created by http_server, which performs the
+// handshake and passes the websocket to the handler for the route.
+//
+// Messages are received directly into a buffer owned by the caller: payload
+// data is read from the socket straight into that buffer wherever possible,
+// and unmasked in place, so fragmented messages are reassembled without any
+// extra copies. Pings are answered, and the closing handshake is completed,
+// automatically.
+//
+// Each read from the stream must deliver something within the idle timeout,
+// so that a peer which goes quiet (or trickles in a frame a byte at a time)
+// cannot hold the connection open for ever. A receive which times out fails
+// with std::errc::timed_out, and the websocket is closed with the going_away
+// code.
+//
+// At most one receive and one send may be in progress at a time. The
+// websocket may be destroyed once neither is in progress, even if it is still
+// answering a ping or a close frame in the background.
+class websocket {
+ public:
+  // Construct an empty websocket.
+  websocket() noexcept;
+  // Communicate over a stream which has completed the opening handshake. Any
+  // bytes which were read from the stream after the handshake are passed as
+  // buffered input. The on_close function is invoked once the websocket has
+  // finished with the stream. Each read must complete within the idle timeout.
+  websocket(
+      tcp::stream stream, span<const char> buffered = {},
+      unique_function<void()> on_close = nullptr,
+      executor::duration idle_timeout = std::chrono::seconds(60)) noexcept;
+  ~websocket() noexcept;
+
+  // Not copyable.
+  websocket(const websocket&) = delete;
+  websocket& operator=(const websocket&) = delete;
+
+  // Movable.
+  websocket(websocket&&) noexcept;
+  websocket& operator=(websocket&&) noexcept;
+
+  // Receive the next message into the given buffer. The continuation is
+  // invoked either with the message or a status describing the failure. A
+  // message which does not fit in the buffer fails with
+  // std::errc::message_size, and a peer which breaks the protocol causes a
+  // failure with std::errc::protocol_error; either way, the websocket is
+  // closed with the corresponding close code.
+  void receive(span<char> buffer,
+               unique_function<void(result<websocket_message>)> done) noexcept;
+
+  // Send a complete text or binary message, or a ping or pong. The data must
+  // remain valid until the continuation is invoked.
+  void send(websocket_opcode type, span<const char> data,
+            unique_function<void(status)> done) noexcept;
+  // Send one fragment of a message. The first fragment has the type of the
+  // message and every following fragment has type continuation. The last
+  // fragment is marked as final.
+  void send_fragment(websocket_opcode type, span<const char> data, bool final,
+                     unique_function<void(status)> done) noexcept;
+
+  // Start the closing handshake. The continuation is invoked once the close
+  // frame has been sent, and the peer's reply arrives as a close message from
+  // receive(). Nothing can be sent afterwards.
+  void close(websocket_close_code code,
+             unique_function<void(status)> done) noexcept;
+
+  // Awaitable versions of the operations above, for use in coroutines.
+  auto receive(span<char> buffer) noexcept {
+    return await_callback<result<websocket_message>>(
+        [this, buffer](auto done) { receive(buffer, std::move(done)); });
+  }
+  auto send(websocket_opcode type, span<const char> data) noexcept {
+    return await_callback<status>([this, type, data](auto done) {
+      send(type, data, std::move(done));
+    });
+  }
+  auto send_fragment(websocket_opcode type, span<const char> data,
+                     bool final) noexcept {
+    return await_callback<status>([this, type, data, final](auto done) {
+      send_fragment(type, data, final, std::move(done));
+    });
+  }
+  auto close(websocket_close_code code) noexcept {
+    return await_callback<status>(
+        [this, code](auto done) { close(code, std::move(done)); });
+  }
+
+  // Check if the websocket is initialised (non-empty).
+  explicit operator bool() const noexcept;
+
+  // Access the context which the websocket runs on. Only valid if the
+  // websocket is non-empty.
+  io_context& context() const noexcept;
+
+ private:
+  class state;
+
+  std::unique_ptr<state> state_;
+};
+
+}  // namespace util